@@ -0,0 +1,721 @@
+#include "IncrementInstructionCombining.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <chrono>
+#include <map>
+#ifdef LLVM_ON_UNIX
+#include <sys/resource.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+using namespace llvm;
+
+// combine-report runs the plugin's rules over a module and reports on them: against upstream instcombine, in
+// llvm-mca's throughput estimate and in JIT-compiled run time. Like opt it takes a .ll or .bc file, and the reports
+// to print as flags. The rules' own options (-combine-disable=, ...) work here too.
+
+namespace {
+
+cl::opt<std::string> InputFilename(cl::Positional, cl::desc("<input .ll or .bc file>"), cl::Required);
+
+cl::opt<bool> CompareUpstream("combine-compare-upstream", cl::init(false),
+    cl::desc("Compare the plugin against upstream instcombine on copies of the module"));
+cl::opt<unsigned> CompareGenerate("combine-compare-generate", cl::init(0),
+    cl::desc("Number of synthetic -O0 style functions added to the copies compared by -combine-compare-upstream"));
+cl::opt<bool> ThroughputReport("combine-throughput-report", cl::init(false),
+    cl::desc("Estimate the throughput of every function after each rule with llvm-mca"));
+cl::opt<std::string> ThroughputCPU("combine-throughput-cpu", cl::init("native"),
+    cl::desc("CPU the throughput report lowers and schedules for"));
+cl::opt<std::string> ThroughputMCA("combine-throughput-mca", cl::init("llvm-mca"),
+    cl::desc("llvm-mca binary used by the throughput report"));
+cl::opt<bool> Benchmark("combine-benchmark", cl::init(false),
+    cl::desc("JIT and time the bench_* kernels with and without each rule"));
+cl::opt<unsigned> BenchmarkIterations("combine-benchmark-n", cl::init(1000000),
+    cl::desc("Argument passed to every bench_* kernel, the number of loop iterations it runs"));
+cl::opt<unsigned> BenchmarkWarmup("combine-benchmark-warmup", cl::init(3),
+    cl::desc("Untimed calls of every kernel before it is measured"));
+cl::opt<unsigned> BenchmarkRepetitions("combine-benchmark-repetitions", cl::init(10),
+    cl::desc("Timed calls of every kernel, the fastest one is reported"));
+
+// Analysis managers for running the plugin's passes over a module outside of opt.
+struct StandalonePipeline {
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB;
+
+    explicit StandalonePipeline(TargetMachine *TM = nullptr) : PB(TM) {
+        registerCombineAnalyses(FAM);
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    }
+};
+
+// Runs the plugin alone, upstream instcombine alone and both on copies of the module, then reports the compile time,
+// heap growth and final instruction count of each configuration, followed by the opcodes that one of the first two
+// changed and the other didn't. The module itself is left alone.
+// The timings include the Old IR/New IR dumps that the original rules, RHSMove through InitStoreCombining, print.
+struct UpstreamComparisonPass : public PassInfoMixin<UpstreamComparisonPass> {
+    enum Configuration { PluginOnly, InstCombineOnly, Both };
+    // Function name -> opcode name -> number of instructions.
+    typedef std::map<std::string, std::map<std::string, int>> OpcodeCounts;
+
+    struct Result {
+        TimeRecord Time;
+        long long HeapGrowth = 0;
+        bool Broken = false;
+        OpcodeCounts Opcodes;
+    };
+
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
+        std::unique_ptr<Module> Corpus = CloneModule(M);
+        generateFunctions(*Corpus, CompareGenerate);
+        OpcodeCounts Original = countOpcodes(*Corpus);
+
+        // A report before this one may have left the counting passes' results behind.
+        resetCombineState();
+        Result Results[3];
+        for (int C = PluginOnly; C <= Both; C++)
+            Results[C] = runConfiguration(*Corpus, (Configuration) C);
+
+        // Memory is also given per million instructions of the corpus, so corpora of different sizes compare.
+        const char *Names[] = {"plugin", "instcombine", "plugin+instcombine"};
+        double MillionInstructions = std::max(countInstructions(Original), 1) / 1e6;
+        errs() << "Upstream comparison for " << M.getModuleIdentifier() << " (" << CompareGenerate << " generated functions)\n";
+        errs() << "  configuration            time (s)    heap (KB)  KB/Minstr   instructions\n";
+        errs() << format("  original                        -            -          - %14d\n", countInstructions(Original));
+        for (int C = PluginOnly; C <= Both; C++) {
+            errs() << format("  %-20s %12.6f %12lld %10.0f %14d", Names[C], Results[C].Time.getProcessTime(),
+                             Results[C].HeapGrowth / 1024, Results[C].HeapGrowth / 1024 / MillionInstructions,
+                             countInstructions(Results[C].Opcodes));
+            errs() << (Results[C].Broken ? "  (broken module)\n" : "\n");
+        }
+        if (long PeakKB = getPeakRSSKB())
+            errs() << format("  peak RSS of the process: %ld KB, %.0f KB per million instructions\n", PeakKB,
+                             PeakKB / MillionInstructions);
+
+        // A rewrite shows up as a change in the opcode counts of its function. Where the plugin and instcombine
+        // change the same opcode by different amounts, one of them found something the other didn't.
+        errs() << "  Differences from the original (plugin / instcombine):\n";
+        for (auto &Function : Original) {
+            const std::string &Name = Function.first;
+            std::map<std::string, int> Opcodes = Function.second;
+            for (int C = PluginOnly; C <= InstCombineOnly; C++) {
+                for (auto &Opcode : Results[C].Opcodes[Name])
+                    Opcodes.insert({Opcode.first, 0});
+            }
+            for (auto &Opcode : Opcodes) {
+                int PluginDelta = Results[PluginOnly].Opcodes[Name][Opcode.first] - Opcode.second;
+                int InstCombineDelta = Results[InstCombineOnly].Opcodes[Name][Opcode.first] - Opcode.second;
+                if (PluginDelta == InstCombineDelta)
+                    continue;
+                const char *Verdict = InstCombineDelta == 0 ? "only plugin" : PluginDelta == 0 ? "only instcombine" : "both, differently";
+                errs() << format("    %-30s %-16s %+5d / %+5d  %s\n", Name.c_str(), Opcode.first.c_str(),
+                                 PluginDelta, InstCombineDelta, Verdict);
+            }
+        }
+        return PreservedAnalyses::all();
+    }
+
+    static Result runConfiguration(const Module &Corpus, Configuration C) {
+        std::unique_ptr<Module> Copy = CloneModule(Corpus);
+        StandalonePipeline Pipeline;
+        FunctionPassManager FPM;
+        if (C != InstCombineOnly)
+            addCombinePasses(FPM);
+        if (C != PluginOnly)
+            FPM.addPass(InstCombinePass());
+        ModulePassManager MPM;
+        MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+
+        // TimeRecord only tracks memory with -track-memory, so the heap is measured here.
+        Result R;
+        size_t HeapBefore = sys::Process::GetMallocUsage();
+        R.Time -= TimeRecord::getCurrentTime(true);
+        MPM.run(*Copy, Pipeline.MAM);
+        R.Time += TimeRecord::getCurrentTime(false);
+        R.HeapGrowth = (long long) sys::Process::GetMallocUsage() - (long long) HeapBefore;
+        resetCombineState();
+
+        R.Broken = verifyModule(*Copy, &errs());
+        R.Opcodes = countOpcodes(*Copy);
+        return R;
+    }
+
+    // getrusage's high-water mark, 0 where there is none. It covers the whole process, the other reports included.
+    static long getPeakRSSKB() {
+#ifdef LLVM_ON_UNIX
+        struct rusage Usage;
+        if (getrusage(RUSAGE_SELF, &Usage) != 0)
+            return 0;
+#ifdef __APPLE__
+        return Usage.ru_maxrss / 1024;
+#else
+        return Usage.ru_maxrss;
+#endif
+#else
+        return 0;
+#endif
+    }
+
+    static OpcodeCounts countOpcodes(const Module &M) {
+        OpcodeCounts Counts;
+        for (auto &F : M) {
+            if (F.isDeclaration())
+                continue;
+            auto &FunctionCounts = Counts[F.getName().str()];
+            for (auto &BB : F) {
+                for (auto &I : BB)
+                    FunctionCounts[I.getOpcodeName()]++;
+            }
+        }
+        return Counts;
+    }
+
+    static int countInstructions(const OpcodeCounts &Counts) {
+        int Total = 0;
+        for (auto &Function : Counts) {
+            for (auto &Opcode : Function.second)
+                Total += Opcode.second;
+        }
+        return Total;
+    }
+
+    // Adds Count functions in the shape clang -O0 gives the examples: locals in allocas, increments through
+    // load/add/store, a multiplication by a power of two and a compare. The shape varies with the function's index.
+    static void generateFunctions(Module &M, unsigned Count) {
+        LLVMContext &Ctx = M.getContext();
+        Type *Int32 = Type::getInt32Ty(Ctx);
+        FunctionType *FT = FunctionType::get(Int32, {Int32}, false);
+        for (unsigned N = 0; N < Count; N++) {
+            Function *F = Function::Create(FT, GlobalValue::ExternalLinkage, "combine_generated_" + Twine(N), M);
+            IRBuilder<> Builder(BasicBlock::Create(Ctx, "entry", F));
+
+            unsigned VariableCount = 1 + N % 3;
+            SmallVector<AllocaInst *, 3> Variables;
+            for (unsigned V = 0; V < VariableCount; V++)
+                Variables.push_back(Builder.CreateAlloca(Int32));
+            for (unsigned V = 0; V < VariableCount; V++)
+                Builder.CreateStore(V == 0 ? (Value *) F->getArg(0) : Builder.getInt32(N + V), Variables[V]);
+
+            for (unsigned K = 0; K < 2 + N % 4; K++) {
+                AllocaInst *Variable = Variables[K % VariableCount];
+                Value *Loaded = Builder.CreateLoad(Int32, Variable);
+                Builder.CreateStore(Builder.CreateNSWAdd(Loaded, Builder.getInt32(1 + K % 2)), Variable);
+            }
+
+            Value *Sum = Builder.CreateLoad(Int32, Variables[0]);
+            for (unsigned V = 1; V < VariableCount; V++)
+                Sum = Builder.CreateNSWAdd(Sum, Builder.CreateLoad(Int32, Variables[V]));
+            Sum = Builder.CreateNSWMul(Sum, Builder.getInt32(1u << (1 + N % 4)));
+            Value *Compare = Builder.CreateICmpSGT(Sum, Builder.getInt32(N));
+            Builder.CreateRet(Builder.CreateZExt(Compare, Int32));
+        }
+    }
+};
+
+// Lowers every function of a copy of the module for -combine-throughput-cpu and has llvm-mca estimate it, first as it
+// is and then after each of the plugin's rules in turn. Reports cycles and uops per iteration, the block reciprocal
+// throughput and the busiest resource for every function a rule changed, and flags the rewrites estimated slower.
+// The rule summary at the end adds up the change in cycles over all functions, per rule.
+// Without llvm-mca the estimate falls back to the target's TTI reciprocal throughput cost.
+// The module itself is left alone.
+struct ThroughputReportPass : public PassInfoMixin<ThroughputReportPass> {
+    struct Estimate {
+        bool Valid = false;
+        double Cycles = 0;
+        double UOps = 0;
+        double RThroughput = 0;
+        std::string BusiestResource;
+        double BusiestPressure = 0;
+    };
+
+    struct RuleSummary {
+        double CyclesDelta = 0;
+        int Changed = 0;
+        int Slower = 0;
+    };
+
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
+        std::string CPU = ThroughputCPU == "native" ? sys::getHostCPUName().str() : ThroughputCPU.getValue();
+        std::string Error;
+        std::unique_ptr<TargetMachine> TM = createTargetMachine(M, CPU, Error);
+        if (!TM) {
+            errs() << "Throughput report: " << Error << "\n";
+            return PreservedAnalyses::all();
+        }
+        std::string MCA;
+        if (ErrorOr<std::string> Found = sys::findProgramByName(ThroughputMCA))
+            MCA = *Found;
+        else
+            errs() << "Throughput report: " << ThroughputMCA << " not found, using TTI costs instead\n";
+
+        std::unique_ptr<Module> Copy = CloneModule(M);
+        Copy->setTargetTriple(TM->getTargetTriple().str());
+        Copy->setDataLayout(TM->createDataLayout());
+
+        StandalonePipeline Pipeline(TM.get());
+
+        errs() << "Throughput report for " << M.getModuleIdentifier() << " on " << TM->getTargetTriple().str() << " " << CPU
+               << (MCA.empty() ? " (TTI cost)" : " (llvm-mca)") << "\n";
+        errs() << "  function                       rule                                cycles/iter  uops/iter  rthroughput  busiest resource\n";
+
+        // Text of each function after the last step, so only the functions a rule touched are estimated again.
+        std::map<std::string, std::string> Texts;
+        std::map<std::string, Estimate> Estimates;
+        for (auto &F : *Copy) {
+            if (F.isDeclaration())
+                continue;
+            std::string Name = F.getName().str();
+            Texts[Name] = printFunction(F);
+            Estimates[Name] = estimate(*Copy, F, *TM, CPU, MCA);
+            printEstimate(Name, "original", Estimates[Name], nullptr);
+        }
+
+        resetCombineState();
+        std::vector<std::pair<const char *, RuleSummary>> Summaries;
+        for (const CombineStep &Step : getCombineSteps()) {
+            if (isCombineStepDisabled(Step))
+                continue;
+            FunctionPassManager FPM;
+            Step.Add(FPM);
+            ModulePassManager MPM;
+            MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+            MPM.run(*Copy, Pipeline.MAM);
+
+            RuleSummary Summary;
+            for (auto &F : *Copy) {
+                auto Text = Texts.find(F.getName().str());
+                if (F.isDeclaration() || Text == Texts.end())
+                    continue;
+                std::string NewText = printFunction(F);
+                if (NewText == Text->second)
+                    continue;
+                Text->second = NewText;
+
+                Estimate &Before = Estimates[Text->first];
+                Estimate After = estimate(*Copy, F, *TM, CPU, MCA);
+                printEstimate(Text->first, Step.Name, After, &Before);
+                if (Before.Valid && After.Valid) {
+                    Summary.CyclesDelta += After.Cycles - Before.Cycles;
+                    Summary.Changed++;
+                    if (After.Cycles > Before.Cycles)
+                        Summary.Slower++;
+                }
+                Before = After;
+            }
+            Summaries.push_back({Step.Name, Summary});
+        }
+        resetCombineState();
+
+        errs() << "  Rule summary (" << CPU << "):\n";
+        for (auto &Rule : Summaries) {
+            if (Rule.second.Changed == 0)
+                continue;
+            errs() << format("    %-34s %+10.2f cycles/iter over %d functions, %d slower\n", Rule.first,
+                             Rule.second.CyclesDelta, Rule.second.Changed, Rule.second.Slower);
+        }
+        return PreservedAnalyses::all();
+    }
+
+    static std::unique_ptr<TargetMachine> createTargetMachine(const Module &M, const std::string &CPU, std::string &Error) {
+        std::string TripleName = M.getTargetTriple().empty() ? sys::getDefaultTargetTriple() : M.getTargetTriple();
+        const Target *T = TargetRegistry::lookupTarget(TripleName, Error);
+        if (!T)
+            return nullptr;
+        return std::unique_ptr<TargetMachine>(
+            T->createTargetMachine(TripleName, CPU, "", TargetOptions(), None, None, CodeGenOpt::Default));
+    }
+
+    static std::string printFunction(const Function &F) {
+        std::string Text;
+        raw_string_ostream OS(Text);
+        F.print(OS);
+        return OS.str();
+    }
+
+    static void printEstimate(const std::string &Function, const char *Rule, const Estimate &After, const Estimate *Before) {
+        if (!After.Valid) {
+            errs() << format("  %-30s %-34s          n/a\n", Function.c_str(), Rule);
+            return;
+        }
+        errs() << format("  %-30s %-34s %12.2f %10.2f %12.2f  %s %.2f", Function.c_str(), Rule, After.Cycles, After.UOps,
+                         After.RThroughput, After.BusiestResource.c_str(), After.BusiestPressure);
+        if (Before && Before->Valid) {
+            errs() << format("  (%+.2f cycles)", After.Cycles - Before->Cycles);
+            if (After.Cycles > Before->Cycles)
+                errs() << "  SLOWER";
+        }
+        errs() << "\n";
+    }
+
+    static Estimate estimate(const Module &M, const Function &F, TargetMachine &TM, const std::string &CPU, const std::string &MCA) {
+        if (MCA.empty())
+            return estimateWithTTI(F, TM);
+        SmallString<0> Asm;
+        if (!emitAssembly(M, F.getName(), TM, Asm))
+            return Estimate();
+        return runMCA(Asm, TM.getTargetTriple().str(), CPU, MCA);
+    }
+
+    static Estimate estimateWithTTI(const Function &F, TargetMachine &TM) {
+        TargetTransformInfo TTI = TM.getTargetTransformInfo(F);
+        Estimate E;
+        for (auto &BB : F) {
+            for (auto &I : BB) {
+                InstructionCost Cost = TTI.getInstructionCost(&I, TargetTransformInfo::TCK_RecipThroughput);
+                if (Cost.isValid())
+                    E.RThroughput += *Cost.getValue();
+            }
+        }
+        E.Cycles = E.RThroughput;
+        E.Valid = true;
+        return E;
+    }
+
+    // Only F keeps its body, so the assembly is the code of that one function.
+    static bool emitAssembly(const Module &M, StringRef FunctionName, TargetMachine &TM, SmallString<0> &Asm) {
+        std::unique_ptr<Module> Copy = CloneModule(M);
+        for (auto &Other : *Copy) {
+            if (!Other.isDeclaration() && Other.getName() != FunctionName)
+                Other.deleteBody();
+        }
+        raw_svector_ostream OS(Asm);
+        legacy::PassManager PM;
+        if (TM.addPassesToEmitFile(PM, OS, nullptr, CGFT_AssemblyFile))
+            return false;
+        PM.run(*Copy);
+        return true;
+    }
+
+    static Estimate runMCA(StringRef Asm, const std::string &TripleName, const std::string &CPU, const std::string &MCA) {
+        Estimate E;
+        int FD;
+        SmallString<128> AsmPath, OutPath;
+        if (sys::fs::createTemporaryFile("combine-throughput", "s", FD, AsmPath))
+            return E;
+        {
+            raw_fd_ostream OS(FD, /* shouldClose */ true);
+            OS << Asm;
+        }
+        if (sys::fs::createTemporaryFile("combine-throughput", "txt", OutPath)) {
+            sys::fs::remove(AsmPath);
+            return E;
+        }
+
+        std::string TripleArg = "-mtriple=" + TripleName;
+        std::string CPUArg = "-mcpu=" + CPU;
+        StringRef Args[] = {MCA, TripleArg, CPUArg, "-instruction-info=false", AsmPath};
+        Optional<StringRef> Redirects[] = {None, StringRef(OutPath), StringRef("")};
+        int Status = sys::ExecuteAndWait(MCA, Args, None, Redirects);
+        ErrorOr<std::unique_ptr<MemoryBuffer>> Output = MemoryBuffer::getFile(OutPath);
+        sys::fs::remove(AsmPath);
+        sys::fs::remove(OutPath);
+        if (Status != 0 || !Output)
+            return E;
+        return parseMCAOutput((*Output)->getBuffer());
+    }
+
+    // Reads the summary view and the resource pressure per iteration from llvm-mca's text output.
+    static Estimate parseMCAOutput(StringRef Output) {
+        Estimate E;
+        SmallVector<StringRef, 64> Lines;
+        Output.split(Lines, '\n');
+        double Iterations = 0;
+        std::vector<std::string> Resources;
+        for (size_t L = 0; L < Lines.size(); L++) {
+            StringRef Line = Lines[L].trim();
+            StringRef Value = Line.substr(Line.find(':') + 1).trim();
+            if (Line.startswith("Iterations:"))
+                Value.getAsDouble(Iterations);
+            else if (Line.startswith("Total Cycles:"))
+                Value.getAsDouble(E.Cycles);
+            else if (Line.startswith("Total uOps:"))
+                Value.getAsDouble(E.UOps);
+            else if (Line.startswith("Block RThroughput:"))
+                Value.getAsDouble(E.RThroughput);
+            else if (Line.startswith("[") && Line.contains("] "))
+                Resources.push_back(Line.substr(Line.find("- ") + 2).str());
+            else if (Line.startswith("Resource pressure per iteration:") && L + 2 < Lines.size()) {
+                SmallVector<StringRef, 16> Pressures;
+                Lines[L + 2].split(Pressures, ' ', -1, /* KeepEmpty */ false);
+                for (size_t R = 0; R < Pressures.size() && R < Resources.size(); R++) {
+                    double Pressure = 0;
+                    if (!Pressures[R].getAsDouble(Pressure) && Pressure > E.BusiestPressure) {
+                        E.BusiestPressure = Pressure;
+                        E.BusiestResource = Resources[R];
+                    }
+                }
+                break;
+            }
+        }
+        if (Iterations == 0)
+            return E;
+        E.Cycles /= Iterations;
+        E.UOps /= Iterations;
+        E.Valid = true;
+        return E;
+    }
+};
+
+// Times the bench_* kernels of the module (see examples/bench_kernels.c) compiled by ORC LLJIT for this machine:
+// without the plugin's rules, with all of them, and with all but one for every rule that changes the module.
+// Every kernel gets -combine-benchmark-n as its argument and is called -combine-benchmark-warmup times untimed,
+// then -combine-benchmark-repetitions times timed; the fastest call counts. Results are in TSC cycles per
+// iteration on x86 and nanoseconds per iteration elsewhere. The speedup of "all rules" is against no rules, the
+// speedup on a "without" line is what that one rule gains on top of the others. A kernel returning something else
+// than without the rules is flagged as a mismatch. The module itself is left alone.
+struct RuntimeBenchmarkPass : public PassInfoMixin<RuntimeBenchmarkPass> {
+    struct Timing {
+        bool Valid = false;
+        double PerIteration = 0;
+        int64_t Result = 0;
+    };
+    // Kernel name -> timing.
+    typedef std::map<std::string, Timing> Timings;
+    // Kernel name -> width of its argument and result.
+    typedef std::map<std::string, unsigned> Kernels;
+
+#if defined(__x86_64__) || defined(__i386__)
+    static constexpr const char *TickUnit = "cycles";
+    static uint64_t readTicks() {
+        return __rdtsc();
+    }
+#else
+    static constexpr const char *TickUnit = "ns";
+    static uint64_t readTicks() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+#endif
+
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+
+        Kernels KernelWidths;
+        for (auto &F : M) {
+            FunctionType *FT = F.getFunctionType();
+            Type *ResultTy = FT->getReturnType();
+            if (F.isDeclaration() || !F.getName().startswith("bench_") || FT->getNumParams() != 1 || FT->getParamType(0) != ResultTy)
+                continue;
+            if (ResultTy->isIntegerTy(32) || ResultTy->isIntegerTy(64))
+                KernelWidths[F.getName().str()] = ResultTy->getIntegerBitWidth();
+        }
+        if (KernelWidths.empty()) {
+            errs() << "Benchmark: no bench_* kernels taking and returning i32 or i64 in " << M.getModuleIdentifier() << "\n";
+            return PreservedAnalyses::all();
+        }
+
+        // The JIT owns its modules together with their context, so every configuration gets a fresh copy.
+        SmallVector<char, 0> Bitcode;
+        raw_svector_ostream BitcodeOS(Bitcode);
+        WriteBitcodeToFile(M, BitcodeOS);
+
+        ArrayRef<CombineStep> Steps = getCombineSteps();
+        size_t StepCount = Steps.size();
+        std::vector<bool> AllEnabled(StepCount);
+        for (size_t S = 0; S < StepCount; S++)
+            AllEnabled[S] = !isCombineStepDisabled(Steps[S]);
+        std::string AllText;
+        Timings None = runConfiguration(Bitcode, std::vector<bool>(StepCount, false), KernelWidths, nullptr);
+        Timings All = runConfiguration(Bitcode, AllEnabled, KernelWidths, &AllText);
+
+        errs() << "Benchmark of " << M.getModuleIdentifier() << ", n = " << BenchmarkIterations << ", " << TickUnit
+               << " per iteration\n";
+        errs() << "  kernel                         configuration                              per iter    speedup\n";
+        for (auto &Kernel : KernelWidths) {
+            Timing &NoRules = None[Kernel.first];
+            Timing &AllRules = All[Kernel.first];
+            printTiming(Kernel.first, "no rules", NoRules, NoRules, 0);
+            printTiming(Kernel.first, "all rules", AllRules, NoRules, speedup(NoRules, AllRules));
+        }
+
+        // The speedup of a rule is how much slower the kernel gets when only that rule is left out.
+        for (size_t S = 0; S < StepCount; S++) {
+            if (!AllEnabled[S])
+                continue;
+            std::vector<bool> Enabled = AllEnabled;
+            Enabled[S] = false;
+            std::string WithoutText;
+            Timings Without = runConfiguration(Bitcode, Enabled, KernelWidths, &WithoutText, &AllText);
+            if (WithoutText == AllText)
+                continue;
+            std::string Name = std::string("without ") + Steps[S].Name;
+            for (auto &Kernel : KernelWidths) {
+                Timing &WithoutRule = Without[Kernel.first];
+                printTiming(Kernel.first, Name.c_str(), WithoutRule, None[Kernel.first], speedup(WithoutRule, All[Kernel.first]));
+            }
+        }
+        return PreservedAnalyses::all();
+    }
+
+    // How many times faster Faster runs than Slower, 0 if either wasn't measured.
+    static double speedup(const Timing &Slower, const Timing &Faster) {
+        if (!Slower.Valid || !Faster.Valid || Faster.PerIteration == 0)
+            return 0;
+        return Slower.PerIteration / Faster.PerIteration;
+    }
+
+    static void printTiming(const std::string &Kernel, const char *Configuration, const Timing &T, const Timing &Expected,
+                            double Speedup) {
+        if (!T.Valid) {
+            errs() << format("  %-30s %-40s          n/a\n", Kernel.c_str(), Configuration);
+            return;
+        }
+        errs() << format("  %-30s %-40s %12.3f", Kernel.c_str(), Configuration, T.PerIteration);
+        if (Speedup != 0)
+            errs() << format(" %9.3fx", Speedup);
+        if (Expected.Valid && Expected.Result != T.Result)
+            errs() << "  MISMATCH (" << T.Result << " instead of " << Expected.Result << ")";
+        errs() << "\n";
+    }
+
+    // Runs the enabled rules over a fresh copy of the module, then JITs and times every kernel.
+    // The module text after the rules goes to Text; if it equals Skip, nothing is timed.
+    static Timings runConfiguration(ArrayRef<char> Bitcode, const std::vector<bool> &Enabled, const Kernels &KernelWidths,
+                                    std::string *Text, const std::string *Skip = nullptr) {
+        Timings Result;
+        auto Context = std::make_unique<LLVMContext>();
+        Expected<std::unique_ptr<Module>> Parsed =
+            parseBitcodeFile(MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()), "benchmark"), *Context);
+        if (!Parsed) {
+            logAllUnhandledErrors(Parsed.takeError(), errs(), "Benchmark: ");
+            return Result;
+        }
+        std::unique_ptr<Module> Mod = std::move(*Parsed);
+
+        {
+            StandalonePipeline Pipeline;
+            FunctionPassManager FPM;
+            for (size_t S = 0; S < Enabled.size(); S++) {
+                if (Enabled[S])
+                    getCombineSteps()[S].Add(FPM);
+            }
+            ModulePassManager MPM;
+            MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+            MPM.run(*Mod, Pipeline.MAM);
+            resetCombineState();
+        }
+        if (Text) {
+            raw_string_ostream OS(*Text);
+            Mod->print(OS, nullptr);
+            OS.flush();
+            if (Skip && *Text == *Skip)
+                return Result;
+        }
+        if (verifyModule(*Mod, &errs()))
+            return Result;
+
+        Expected<std::unique_ptr<orc::LLJIT>> JIT = orc::LLJITBuilder().create();
+        if (!JIT) {
+            logAllUnhandledErrors(JIT.takeError(), errs(), "Benchmark: ");
+            return Result;
+        }
+        orc::LLJIT &J = **JIT;
+        Mod->setDataLayout(J.getDataLayout());
+        Mod->setTargetTriple(J.getTargetTriple().str());
+        // Kernels may call into libc.
+        J.getMainJITDylib().addGenerator(
+            cantFail(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(J.getDataLayout().getGlobalPrefix())));
+        if (Error Err = J.addIRModule(orc::ThreadSafeModule(std::move(Mod), std::move(Context)))) {
+            logAllUnhandledErrors(std::move(Err), errs(), "Benchmark: ");
+            return Result;
+        }
+
+        for (auto &Kernel : KernelWidths) {
+            Expected<JITEvaluatedSymbol> Symbol = J.lookup(Kernel.first);
+            if (!Symbol) {
+                logAllUnhandledErrors(Symbol.takeError(), errs(), "Benchmark: ");
+                continue;
+            }
+            Result[Kernel.first] = timeKernel(Symbol->getAddress(), Kernel.second);
+        }
+        return Result;
+    }
+
+    static Timing timeKernel(JITTargetAddress Address, unsigned Width) {
+        int64_t N = BenchmarkIterations;
+        auto Call = [Address, Width, N]() -> int64_t {
+            if (Width == 32)
+                return jitTargetAddressToFunction<int32_t (*)(int32_t)>(Address)((int32_t) N);
+            return jitTargetAddressToFunction<int64_t (*)(int64_t)>(Address)(N);
+        };
+
+        Timing T;
+        T.Result = Call();
+        for (unsigned W = 1; W < BenchmarkWarmup; W++)
+            Call();
+        uint64_t Fastest = UINT64_MAX;
+        for (unsigned R = 0; R < BenchmarkRepetitions; R++) {
+            uint64_t Start = readTicks();
+            Call();
+            Fastest = std::min(Fastest, readTicks() - Start);
+        }
+        T.PerIteration = (double) Fastest / std::max<int64_t>(N, 1);
+        T.Valid = BenchmarkRepetitions > 0;
+        return T;
+    }
+};
+}
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    InitializeAllTargetInfos();
+    InitializeAllTargets();
+    InitializeAllTargetMCs();
+    InitializeAllAsmPrinters();
+    InitializeAllAsmParsers();
+    cl::ParseCommandLineOptions(argc, argv, "reports on the combining rules\n");
+    if (!CompareUpstream && !ThroughputReport && !Benchmark) {
+        errs() << argv[0] << ": no report asked for, pass -combine-compare-upstream, -combine-throughput-report"
+               << " or -combine-benchmark\n";
+        return 1;
+    }
+
+    LLVMContext Context;
+    SMDiagnostic Err;
+    std::unique_ptr<Module> M = parseIRFile(InputFilename, Err, Context);
+    if (!M) {
+        Err.print(argv[0], errs());
+        return 1;
+    }
+
+    StandalonePipeline Pipeline;
+    ModulePassManager MPM;
+    if (CompareUpstream)
+        MPM.addPass(UpstreamComparisonPass());
+    if (ThroughputReport)
+        MPM.addPass(ThroughputReportPass());
+    if (Benchmark)
+        MPM.addPass(RuntimeBenchmarkPass());
+    MPM.run(*M, Pipeline.MAM);
+    return 0;
+}
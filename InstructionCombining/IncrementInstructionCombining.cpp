@@ -1,23 +1,69 @@
+#include "IncrementInstructionCombining.h"
 #include "llvm/Pass.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
 #include "llvm/IR/IRBuilder.h"
-
-#include <unordered_map>
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/IR/ValueMap.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/KnownBits.h"
 using namespace llvm;
+using namespace llvm::PatternMatch;
 
 namespace {
 
-std::unordered_map<std::string, int> AllocaCounts;
-std::unordered_map<Value*, int> PatternCounts;
-std::unordered_map<Value*, int> InitialStoredValues;
+cl::opt<bool> CombineHotOnly("combine-hot-only", cl::init(false),
+    cl::desc("Run the expensive combining rules (increment merging, reassociation, load/store merging, "
+             "cast and select folding) only in hot blocks"));
+cl::opt<bool> CombineIncremental("combine-incremental", cl::init(true),
+    cl::desc("Skip the functions nothing changed since the combine engine last ran over them"));
+cl::list<std::string> CombineDisabled("combine-disable", cl::CommaSeparated,
+    cl::desc("Rules left out of the combine engine, by their pipeline names (e.g. rhs-move,bit-idiom)"));
+
+enum CombineExtensionPoint { PipelineStartEP, PeepholeEP, ScalarOptimizerLateEP, NoEP };
+cl::opt<CombineExtensionPoint> CombineEP("combine-ep", cl::init(PipelineStartEP),
+    cl::desc("Where the default pipelines run the combine engine"),
+    cl::values(clEnumValN(PipelineStartEP, "pipeline-start", "At the start, on the unoptimised loads and stores"),
+               clEnumValN(PeepholeEP, "peephole", "After each instcombine, on SSA values"),
+               clEnumValN(ScalarOptimizerLateEP, "scalar-late", "After the function simplification passes"),
+               clEnumValN(NoEP, "none", "Only where -passes= names it")));
+
+// The tables the rules share. The Value keys are ValueMap handles, so an instruction erased by one rule drops out
+// of every table instead of leaving a dangling key behind for the next value allocated at the same address.
+// The function names of AllocaCounts live in an arena that resetCombineState frees in one go.
+StringMap<int, BumpPtrAllocator> AllocaCounts;
+ValueMap<Value*, int> PatternCounts;
+ValueMap<Value*, int> InitialStoredValues;
 std::vector<Instruction *> InstructionsToRemove;
 
 
-std::unordered_map<Value*, Value *> ValuesMap;
+// Load or zext -> the address or value it reads, and stored value -> address, for the function mapVariables saw last.
+ValueMap<Value*, WeakVH> ValuesMap;
 void mapVariables(Function &F) {
+    ValuesMap.clear();
     for (auto &BB : F) {
         for(auto &I : BB) {
             if(isa<LoadInst>(&I)) {
@@ -33,166 +79,573 @@ void mapVariables(Function &F) {
     }
 }
 
+// Erases everything queued in InstructionsToRemove, then keeps erasing the operands that died with it,
+// so loads feeding a removed add or an unused zext don't have to wait for a separate DCE pass.
+// An alloca left with nothing but stores into it is dead too and goes away together with those stores.
+void eraseQueuedInstructions() {
+    SmallSetVector<Instruction *, 16> Queued(InstructionsToRemove.begin(), InstructionsToRemove.end());
+    InstructionsToRemove.clear();
+
+    SmallSetVector<Instruction *, 16> Worklist;
+    for (Instruction *I : Queued) {
+        for (Value *Op : I->operands()) {
+            auto *OpInstr = dyn_cast<Instruction>(Op);
+            if (OpInstr && !Queued.count(OpInstr))
+                Worklist.insert(OpInstr);
+        }
+        I->dropAllReferences();
+    }
+    for (Instruction *I : Queued) {
+        I->eraseFromParent();
+    }
+
+    while (!Worklist.empty()) {
+        Instruction *I = Worklist.pop_back_val();
+        if (auto *Alloca = dyn_cast<AllocaInst>(I)) {
+            bool OnlyStoredTo = all_of(Alloca->users(), [Alloca](User *U) {
+                auto *Store = dyn_cast<StoreInst>(U);
+                return Store && Store->isSimple() && Store->getPointerOperand() == Alloca;
+            });
+            if (!OnlyStoredTo)
+                continue;
+            for (User *U : make_early_inc_range(Alloca->users())) {
+                auto *Store = cast<StoreInst>(U);
+                if (auto *StoredInstr = dyn_cast<Instruction>(Store->getValueOperand()))
+                    Worklist.insert(StoredInstr);
+                Store->eraseFromParent();
+            }
+            Alloca->eraseFromParent();
+            continue;
+        }
+        if (!isInstructionTriviallyDead(I))
+            continue;
+        for (Value *Op : I->operands()) {
+            if (auto *OpInstr = dyn_cast<Instruction>(Op))
+                Worklist.insert(OpInstr);
+        }
+        I->eraseFromParent();
+    }
+}
+
+// With -combine-hot-only, decides whether a block is worth the expensive rules.
+// PGO data is used through the profile summary if present, otherwise the static estimate
+// counts a block as hot when it runs at least as often as the function entry.
+// Increment merging only runs on a single block, which that estimate always counts as hot, so without a profile
+// -combine-hot-only only affects cold functions and the rules that go block by block.
+bool isHotBlock(BasicBlock &BB, FunctionAnalysisManager &FAM) {
+    if (!CombineHotOnly)
+        return true;
+    Function &F = *BB.getParent();
+    if (F.hasFnAttribute(Attribute::Cold))
+        return false;
+
+    // A function pass cannot compute a module analysis, the pipeline requires the summary before it runs.
+    auto &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+    auto *PSI = FAM.getResult<ModuleAnalysisManagerFunctionProxy>(F).getCachedResult<ProfileSummaryAnalysis>(*F.getParent());
+    if (PSI && PSI->hasProfileSummary())
+        return PSI->isHotBlock(&BB, &BFI);
+    return BFI.getBlockFreq(&BB).getFrequency() >= BFI.getEntryFreq();
+}
+
+// Increment merging folds every update of a variable into the first one and into its initial store.
+// That is only right when each of them runs exactly once, in order, which a single block guarantees.
+// An increment in a loop body would otherwise end up in the store before the loop.
+bool isStraightLine(Function &F) {
+    return F.size() == 1;
+}
+
+// Increment merging moves updates across the whole function, so it only runs when every block is hot.
+bool isHotFunction(Function &F, FunctionAnalysisManager &FAM) {
+    for (auto &BB : F) {
+        if (!isHotBlock(BB, FAM))
+            return false;
+    }
+    return true;
+}
+
+// Wide accesses built from narrow ones keep the narrow alignment, so they are only formed when that is cheap on the target.
+bool isFastAccess(Type *Ty, Align Alignment, unsigned AddrSpace, const DataLayout &DL, const TargetTransformInfo &TTI) {
+    if (Alignment.value() >= DL.getTypeStoreSize(Ty))
+        return true;
+    bool Fast = false;
+    return TTI.allowsMisalignedMemoryAccesses(Ty->getContext(), DL.getTypeSizeInBits(Ty), AddrSpace, Alignment, &Fast) && Fast;
+}
+
+// Unoptimised code reloads a variable before every use, so two different loads can still be the same value:
+// same address and nothing that may write memory in between. The second load may also sit in a block
+// that is only entered from the first one, like the arms of  c ? a : b.
+bool isSameLoadedValue(Value *A, Value *B) {
+    if (A == B)
+        return true;
+    auto *LoadA = dyn_cast<LoadInst>(A);
+    auto *LoadB = dyn_cast<LoadInst>(B);
+    if (!LoadA || !LoadB || !LoadA->isSimple() || !LoadB->isSimple())
+        return false;
+    if (LoadA->getPointerOperand() != LoadB->getPointerOperand() || LoadA->getType() != LoadB->getType())
+        return false;
+    if (LoadA->getParent() == LoadB->getParent() && LoadB->comesBefore(LoadA))
+        std::swap(LoadA, LoadB);
+    else if (LoadA->getParent()->getSinglePredecessor() == LoadB->getParent())
+        std::swap(LoadA, LoadB);
+
+    BasicBlock *BlockA = LoadA->getParent();
+    BasicBlock *BlockB = LoadB->getParent();
+    if (BlockA != BlockB && BlockB->getSinglePredecessor() != BlockA)
+        return false;
+    Instruction *End = BlockA == BlockB ? LoadB : nullptr;
+    for (Instruction *I = LoadA; I != End; I = I->getNextNode()) {
+        if (I->mayWriteToMemory())
+            return false;
+    }
+    if (BlockA != BlockB) {
+        for (Instruction *I = &BlockB->front(); I != LoadB; I = I->getNextNode()) {
+            if (I->mayWriteToMemory())
+                return false;
+        }
+    }
+    return true;
+}
+
+// The rules' remarks go through the function's OptimizationRemarkEmitter: -pass-remarks=combine prints the rewrites,
+// -pass-remarks-missed=combine the candidates that were rejected and why, and -pass-remarks-output=<file> writes
+// everything as YAML or bitstream for opt-viewer. Rewrites carry the change in the target's TTI reciprocal throughput
+// cost; the remark name is the rule.
+const char *RemarkPassName = "combine";
+
+struct CombineRemarks {
+    OptimizationRemarkEmitter &ORE;
+    const TargetTransformInfo &TTI;
+
+    CombineRemarks(Function &F, FunctionAnalysisManager &FAM)
+        : ORE(FAM.getResult<OptimizationRemarkEmitterAnalysis>(F)), TTI(FAM.getResult<TargetIRAnalysis>(F)) {}
+
+    int getCost(Instruction *I) const {
+        InstructionCost Cost = TTI.getInstructionCost(I, TargetTransformInfo::TCK_RecipThroughput);
+        return Cost.isValid() ? *Cost.getValue() : 0;
+    }
+
+    // V and the operands only it uses, which are the ones created with it (for a new value)
+    // or the ones that die with it in eraseQueuedInstructions (for an old one).
+    int getTreeCost(Value *V, unsigned Depth = 6) const {
+        auto *I = dyn_cast<Instruction>(V);
+        if (!I)
+            return 0;
+        int Cost = getCost(I);
+        for (Value *Op : I->operands()) {
+            auto *OpInstr = dyn_cast<Instruction>(Op);
+            if (Depth && OpInstr && OpInstr->hasOneUse())
+                Cost += getTreeCost(OpInstr, Depth - 1);
+        }
+        return Cost;
+    }
+
+    // Old is about to have its uses replaced by New. An existing value already has users, so only a new one is priced.
+    void replaced(StringRef Rule, Instruction *Old, Value *New) {
+        ORE.emit([&]() {
+            int NewCost = New->use_empty() ? getTreeCost(New) : 0;
+            auto *NewInstr = dyn_cast<Instruction>(New);
+            return OptimizationRemark(RemarkPassName, Rule, Old)
+                   << ore::NV("Old", Old->getOpcodeName()) << " replaced by "
+                   << ore::NV("New", NewInstr ? NewInstr->getOpcodeName() : "a constant or argument")
+                   << ", estimated cost delta " << ore::NV("CostDelta", NewCost - getTreeCost(Old));
+        });
+    }
+
+    void rewritten(StringRef Rule, Instruction *At, ArrayRef<Value *> Added, ArrayRef<Instruction *> Removed, StringRef What) {
+        ORE.emit([&]() {
+            int Delta = 0;
+            for (Value *V : Added) {
+                if (auto *I = dyn_cast<Instruction>(V))
+                    Delta += getCost(I);
+            }
+            for (Instruction *I : Removed)
+                Delta -= getCost(I);
+            return OptimizationRemark(RemarkPassName, Rule, At) << What << ", estimated cost delta " << ore::NV("CostDelta", Delta);
+        });
+    }
+
+    // Unoptimised code names its allocas after the variables, temporaries are printed as operands.
+    static std::string getVariableName(Value *V) {
+        if (V->hasName())
+            return V->getName().str();
+        std::string Name;
+        raw_string_ostream OS(Name);
+        V->printAsOperand(OS, false);
+        return OS.str();
+    }
+
+    void missed(StringRef Rule, Instruction *At, StringRef Why) {
+        ORE.emit([&]() {
+            return OptimizationRemarkMissed(RemarkPassName, Rule, At) << Why;
+        });
+    }
+
+    void analysis(StringRef Rule, Instruction *At, StringRef What) {
+        ORE.emit([&]() {
+            return OptimizationRemarkAnalysis(RemarkPassName, Rule, At) << What;
+        });
+    }
+};
+
 // This pass moves constants to RHS in a binary operation
 struct RHSMovePass : public PassInfoMixin<RHSMovePass> {
-    PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
-        for (auto &F : M) {
-            errs() << "Old IR: " << F << "\n";
-            for (auto &BB : F) {
-                for (auto &I : BB) {
-                    if(auto* binary_op = dyn_cast<BinaryOperator>(&I)) {
-                        // We only do a move to RHS if we have Mul or Add
-                        auto opcode = binary_op->getOpcode();
-                        Value* op1 = binary_op->getOperand(0);
-                        Value* op2 = binary_op->getOperand(1);
-                        switch(opcode) {
-                            case Instruction::Add:
-                                if (isa<ConstantInt>(op1) && !isa<ConstantInt>(op2)) {
-                                    IRBuilder<> builder(binary_op);
-                                    Value* new_add = builder.CreateAdd(op2, op1);
-                                    binary_op->replaceAllUsesWith(new_add);
-                                    InstructionsToRemove.push_back(binary_op);
-                                }
-                                break;
-                            case Instruction::Mul:
-                                if (isa<ConstantInt>(op1) && !isa<ConstantInt>(op2)) {
-                                    IRBuilder<> builder(binary_op);
-                                    Value* new_mul = builder.CreateMul(op2, op1);
-                                    binary_op->replaceAllUsesWith(new_mul);
-                                    InstructionsToRemove.push_back(binary_op);
-                                }
-                                break;
+    static bool isRequired() { return true; }
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        CombineRemarks Remarks(F, FAM);
+        errs() << "Old IR: " << F << "\n";
+        for (auto &BB : F) {
+            for (auto &I : BB) {
+                if(auto* binary_op = dyn_cast<BinaryOperator>(&I)) {
+                    // We only do a move to RHS if we have Mul or Add
+                    auto opcode = binary_op->getOpcode();
+                    Value* op1 = binary_op->getOperand(0);
+                    Value* op2 = binary_op->getOperand(1);
+                    switch(opcode) {
+                        case Instruction::Add:
+                            if (isa<ConstantInt>(op1) && !isa<ConstantInt>(op2)) {
+                                IRBuilder<> builder(binary_op);
+                                Value* new_add = builder.CreateAdd(op2, op1);
+                                Remarks.replaced("RHSMove", binary_op, new_add);
+                                binary_op->replaceAllUsesWith(new_add);
+                                InstructionsToRemove.push_back(binary_op);
+                            }
+                            break;
+                        case Instruction::Mul:
+                            if (isa<ConstantInt>(op1) && !isa<ConstantInt>(op2)) {
+                                IRBuilder<> builder(binary_op);
+                                Value* new_mul = builder.CreateMul(op2, op1);
+                                Remarks.replaced("RHSMove", binary_op, new_mul);
+                                binary_op->replaceAllUsesWith(new_mul);
+                                InstructionsToRemove.push_back(binary_op);
+                            }
+                            break;
 
-                            default:
-                                continue;
-                        }
+                        default:
+                            continue;
                     }
                 }
             }
-            for (Instruction* i : InstructionsToRemove) {
-                i->eraseFromParent();
-            }
-           // We also need to remove the instruction from the vector, in order for it to be clean for next passes to use.
-           InstructionsToRemove.clear();
-           // InstructionsToRemove.shrink_to_fit();
-           errs() << "New IR: " << F << "\n";
         }
+        eraseQueuedInstructions();
+       // We also need to remove the instruction from the vector, in order for it to be clean for next passes to use.
+       InstructionsToRemove.clear();
+       // InstructionsToRemove.shrink_to_fit();
+       errs() << "New IR: " << F << "\n";
         return PreservedAnalyses::all();
     }
 };
 
 struct ConvertCompareInstructionsPass : public PassInfoMixin<ConvertCompareInstructionsPass> {
-    PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
+    static bool isRequired() { return true; }
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
         bool changed = false;
         InstructionsToRemove.clear();
-        for (auto &F : M) {
-            errs() << "Old IR: \n" << F << "\n";
-            for (auto &BB : F) {
-                for(auto &I : BB) {
-                    if (auto *CmpInstr = dyn_cast<ICmpInst>(&I)) {
-                        IRBuilder<> Builder(CmpInstr);
-                        Value *LHS = CmpInstr->getOperand(0);
-                        Value *RHS = CmpInstr->getOperand(1);
-                        Value *NewInstr = nullptr;
-
-                        if (auto *RHSConstant = dyn_cast<ConstantInt>(RHS)) {
-                            if (RHSConstant->isZero()) {
-                                switch (CmpInstr->getPredicate()) {
-                                    case ICmpInst::ICMP_SLT:
-                                    case ICmpInst::ICMP_ULT:
-                                        // x < 0 is false for unsigned and x < 0 can be x == 0 for signed
-                                        NewInstr = (Value*) Builder.getFalse();
-                                        break;
-                                    case ICmpInst::ICMP_SGT:
-                                    case ICmpInst::ICMP_UGT:
-                                        // x > 0 can be simplified to x != 0
-                                        NewInstr = Builder.CreateICmpNE(LHS, RHS);
-                                        break;
-                                    case ICmpInst::ICMP_SLE:
-                                    case ICmpInst::ICMP_ULE:
-                                    // x <= 0 can be simplified to x == 0
-                                        NewInstr = Builder.CreateICmpEQ(LHS, RHS);
+        CombineRemarks Remarks(F, FAM);
+        errs() << "Old IR: \n" << F << "\n";
+        for (auto &BB : F) {
+            for(auto &I : BB) {
+                if (auto *CmpInstr = dyn_cast<ICmpInst>(&I)) {
+                    IRBuilder<> Builder(CmpInstr);
+                    Value *LHS = CmpInstr->getOperand(0);
+                    Value *RHS = CmpInstr->getOperand(1);
+                    Value *NewInstr = nullptr;
+
+                    if (auto *RHSConstant = dyn_cast<ConstantInt>(RHS)) {
+                        if (RHSConstant->isZero()) {
+                            // Only the unsigned predicates: a signed x may be negative, so x < 0 is no constant there.
+                            switch (CmpInstr->getPredicate()) {
+                                case ICmpInst::ICMP_ULT:
+                                    // x < 0 is false for unsigned
+                                    NewInstr = (Value*) Builder.getFalse();
+                                    break;
+                                case ICmpInst::ICMP_UGT:
+                                    // x > 0 can be simplified to x != 0
+                                    NewInstr = Builder.CreateICmpNE(LHS, RHS);
+                                    break;
+                                case ICmpInst::ICMP_ULE:
+                                // x <= 0 can be simplified to x == 0
+                                    NewInstr = Builder.CreateICmpEQ(LHS, RHS);
+                                break;
+                                case ICmpInst::ICMP_UGE:
+                                    // x >= 0 is true for unsigned
+                                    NewInstr = (Value*) Builder.getTrue();
+                                    break;
+                                default:
                                     break;
-                                    case ICmpInst::ICMP_SGE:
-                                    case ICmpInst::ICMP_UGE:
-                                        // x >= 0 is true for unsigned and x >= 0 can be simplified to true for signed
-                                        NewInstr = (Value*) Builder.getTrue();
-                                        break;
-                                    default:
-                                        break;
-                                }
                             }
                         }
+                    }
 
-                        if (NewInstr) {
-                            CmpInstr->replaceAllUsesWith(NewInstr);
-                            InstructionsToRemove.push_back(CmpInstr);
-                            changed = true;
-                        }
+                    if (NewInstr) {
+                        Remarks.replaced("ConvertCompare", CmpInstr, NewInstr);
+                        CmpInstr->replaceAllUsesWith(NewInstr);
+                        InstructionsToRemove.push_back(CmpInstr);
+                        changed = true;
+                    } else if (foldOverflowCheck(CmpInstr, Remarks)) {
+                        changed = true;
                     }
                 }
             }
-            for (Instruction *Instr : InstructionsToRemove) {
-                 Instr->eraseFromParent();
-            }
-            errs() << "New IR: \n" << F << "\n";
         }
-        if(changed)
-            return PreservedAnalyses::none();
+        eraseQueuedInstructions();
+
+        // Branches on the folded compares are decided now. The dominator tree, if there is one, is kept up to date.
+        auto *DT = FAM.getCachedResult<DominatorTreeAnalysis>(F);
+        auto *PDT = FAM.getCachedResult<PostDominatorTreeAnalysis>(F);
+        if (changed)
+            foldConstantBranches(F, DT, PDT, Remarks);
+        errs() << "New IR: \n" << F << "\n";
+        if(changed) {
+            PreservedAnalyses PA = PreservedAnalyses::none();
+            PA.preserve<DominatorTreeAnalysis>();
+            PA.preserve<PostDominatorTreeAnalysis>();
+            return PA;
+        }
         return PreservedAnalyses::all();
     }
+
+    // br (constant)  -------> br, then the blocks nobody enters any more are deleted, a block that is its predecessor's
+    // only successor is merged into it, and an if/else whose arms are empty and meet again with the same values is
+    // replaced by a branch to where they meet. Every edge change goes through the DomTreeUpdater.
+    static bool foldConstantBranches(Function &F, DominatorTree *DT, PostDominatorTree *PDT, CombineRemarks &Remarks) {
+        DomTreeUpdater DTU(DT, PDT, DomTreeUpdater::UpdateStrategy::Eager);
+        bool CFGChanged = false;
+        for (auto &BB : F) {
+            auto *Br = dyn_cast<BranchInst>(BB.getTerminator());
+            if (Br && Br->isConditional() && isa<ConstantInt>(Br->getCondition()))
+                Remarks.rewritten("ConstantBranch", Br, {}, {Br}, "branch on a constant condition folded");
+            else if (Br && Br->isConditional() && foldEmptyDiamond(&BB, DTU)) {
+                CFGChanged = true;
+                continue;
+            }
+            CFGChanged |= ConstantFoldTerminator(&BB, true, nullptr, &DTU);
+        }
+        CFGChanged |= removeUnreachableBlocks(F, &DTU);
+        for (auto It = F.begin(); It != F.end();) {
+            BasicBlock *BB = &*It++;
+            CFGChanged |= MergeBlockIntoPredecessor(BB, &DTU);
+        }
+        return CFGChanged;
+    }
+
+    // Where BB goes through Succ: Succ itself, or the target of Succ when it is an empty block only BB enters.
+    static BasicBlock *skipEmptyBlock(BasicBlock *BB, BasicBlock *Succ) {
+        auto *Br = dyn_cast<BranchInst>(Succ->getTerminator());
+        if (Succ != BB && Succ->getSinglePredecessor() == BB && &Succ->front() == Br && Br->isUnconditional())
+            return Br->getSuccessor(0);
+        return Succ;
+    }
+
+    // if (c) {} else {}  and  if (c) {}  with the same phi values on both ways in: the condition no longer matters.
+    static bool foldEmptyDiamond(BasicBlock *BB, DomTreeUpdater &DTU) {
+        auto *Br = cast<BranchInst>(BB->getTerminator());
+        BasicBlock *Then = Br->getSuccessor(0);
+        BasicBlock *Else = Br->getSuccessor(1);
+        BasicBlock *Join = skipEmptyBlock(BB, Then);
+        if (Then == Else || Join == BB || Join != skipEmptyBlock(BB, Else))
+            return false;
+        BasicBlock *FromThen = Then == Join ? BB : Then;
+        BasicBlock *FromElse = Else == Join ? BB : Else;
+        for (PHINode &Phi : Join->phis()) {
+            if (Phi.getIncomingValueForBlock(FromThen) != Phi.getIncomingValueForBlock(FromElse))
+                return false;
+        }
+
+        // The empty arms become unreachable and go with removeUnreachableBlocks, which also drops their phi entries.
+        bool WasPredecessor = FromThen == BB || FromElse == BB;
+        if (!WasPredecessor) {
+            for (PHINode &Phi : Join->phis())
+                Phi.addIncoming(Phi.getIncomingValueForBlock(FromThen), BB);
+        }
+        SmallVector<DominatorTree::UpdateType, 3> Updates;
+        for (BasicBlock *Arm : {Then, Else}) {
+            if (Arm != Join)
+                Updates.push_back({DominatorTree::Delete, BB, Arm});
+        }
+        if (!WasPredecessor)
+            Updates.push_back({DominatorTree::Insert, BB, Join});
+
+        auto *Condition = dyn_cast<Instruction>(Br->getCondition());
+        BranchInst::Create(Join, Br);
+        Br->eraseFromParent();
+        DTU.applyUpdates(Updates);
+        if (Condition && Condition->use_empty()) {
+            InstructionsToRemove.push_back(Condition);
+            eraseQueuedInstructions();
+        }
+        return true;
+    }
+
+    // Unoptimised code stores every result and loads it back for the next statement. For such a reload, with nothing
+    // in between that may write the variable, this is the value that was stored; for anything else V itself.
+    static Value *getForwardedValue(Value *V) {
+        auto *Load = dyn_cast<LoadInst>(V);
+        if (!Load || !Load->isSimple())
+            return V;
+        Value *Ptr = Load->getPointerOperand();
+        for (Instruction *I = Load->getPrevNode(); I; I = I->getPrevNode()) {
+            auto *Store = dyn_cast<StoreInst>(I);
+            if (Store && Store->isSimple() && Store->getPointerOperand() == Ptr)
+                return Store->getValueOperand()->getType() == Load->getType() ? Store->getValueOperand() : V;
+            // A store into another local can't change this one.
+            if (Store && isa<AllocaInst>(Store->getPointerOperand()) && isa<AllocaInst>(Ptr))
+                continue;
+            if (I->mayWriteToMemory())
+                return V;
+        }
+        return V;
+    }
+
+    // Two reloads of a variable are the same value when they read the same store, even with stores
+    // into other locals in between.
+    static bool isSameOperand(Value *A, Value *B) {
+        return isSameLoadedValue(A, B) || getForwardedValue(A) == getForwardedValue(B);
+    }
+
+    // Hand-written overflow tests   -------> the overflow bit of llvm.*.with.overflow, whose value replaces the arithmetic
+    /*
+    **    a + b < a,  a + b < b                        -------> uadd.with.overflow(a, b)
+    **    a - b > a                                    -------> usub.with.overflow(a, b)
+    **    a + C < a  (C > 0),  a + C > a  (C < 0)      -------> sadd.with.overflow(a, C)
+    **    (a * b) / a != b   (udiv / sdiv)             -------> umul / smul.with.overflow(a, b)
+    ** and the negations of all of them. The backend then reads the flags of the add or mul instead of comparing again.
+    ** The division is the test only because it cannot divide by zero; an  a != 0 &&  in front of it stays.
+     */
+    static bool foldOverflowCheck(ICmpInst *CmpInstr, CombineRemarks &Remarks) {
+        ICmpInst::Predicate Predicate = CmpInstr->getPredicate();
+        Value *LHS = CmpInstr->getOperand(0);
+        Value *RHS = CmpInstr->getOperand(1);
+        // Everything is matched as  LHS < RHS  or  LHS != RHS, the other predicates by swapping or negating.
+        bool Negated = false;
+        if (Predicate == ICmpInst::ICMP_UGE || Predicate == ICmpInst::ICMP_SGE || Predicate == ICmpInst::ICMP_EQ) {
+            Predicate = CmpInstr->getInversePredicate();
+            Negated = true;
+        }
+        if (Predicate == ICmpInst::ICMP_UGT || Predicate == ICmpInst::ICMP_SGT || Predicate == ICmpInst::ICMP_ULE ||
+            Predicate == ICmpInst::ICMP_SLE) {
+            Predicate = ICmpInst::getSwappedPredicate(Predicate);
+            std::swap(LHS, RHS);
+            if (Predicate == ICmpInst::ICMP_UGE || Predicate == ICmpInst::ICMP_SGE) {
+                Predicate = ICmpInst::getInversePredicate(Predicate);
+                Negated = !Negated;
+            }
+        }
+
+        BinaryOperator *Arith = nullptr;
+        Intrinsic::ID ID = Intrinsic::not_intrinsic;
+        Value *Operand = nullptr;
+        const APInt *C = nullptr;
+        auto *LHSArith = dyn_cast<BinaryOperator>(getForwardedValue(LHS));
+        auto *RHSArith = dyn_cast<BinaryOperator>(getForwardedValue(RHS));
+        if (Predicate == ICmpInst::ICMP_ULT && LHSArith && LHSArith->getOpcode() == Instruction::Add &&
+            (isSameOperand(LHSArith->getOperand(0), RHS) || isSameOperand(LHSArith->getOperand(1), RHS))) {
+            Arith = LHSArith;
+            ID = Intrinsic::uadd_with_overflow;
+        } else if (Predicate == ICmpInst::ICMP_ULT && RHSArith && RHSArith->getOpcode() == Instruction::Sub &&
+                   isSameOperand(RHSArith->getOperand(0), LHS)) {
+            Arith = RHSArith;
+            ID = Intrinsic::usub_with_overflow;
+        } else if (Predicate == ICmpInst::ICMP_SLT && LHSArith && match(LHSArith, m_Add(m_Value(Operand), m_APInt(C))) &&
+                   !C->isZero() && isSameOperand(Operand, RHS)) {
+            // Without overflow a + C < a is the sign of C, so for a negative C the compare is the negated test.
+            Arith = LHSArith;
+            ID = Intrinsic::sadd_with_overflow;
+            Negated ^= C->isNegative();
+        } else if (Predicate == ICmpInst::ICMP_SLT && RHSArith && match(RHSArith, m_Add(m_Value(Operand), m_APInt(C))) &&
+                   !C->isZero() && isSameOperand(Operand, LHS)) {
+            Arith = RHSArith;
+            ID = Intrinsic::sadd_with_overflow;
+            Negated ^= C->isStrictlyPositive();
+        } else if (Predicate == ICmpInst::ICMP_NE) {
+            for (int Swap = 0; Swap < 2 && !Arith; Swap++, std::swap(LHS, RHS)) {
+                auto *Quotient = dyn_cast<BinaryOperator>(getForwardedValue(LHS));
+                if (!Quotient || (Quotient->getOpcode() != Instruction::UDiv && Quotient->getOpcode() != Instruction::SDiv))
+                    continue;
+                auto *Product = dyn_cast<BinaryOperator>(getForwardedValue(Quotient->getOperand(0)));
+                if (!Product || Product->getOpcode() != Instruction::Mul)
+                    continue;
+                Value *Divisor = Quotient->getOperand(1);
+                if ((isSameOperand(Product->getOperand(0), Divisor) && isSameOperand(Product->getOperand(1), RHS)) ||
+                    (isSameOperand(Product->getOperand(1), Divisor) && isSameOperand(Product->getOperand(0), RHS))) {
+                    Arith = Product;
+                    ID = Quotient->getOpcode() == Instruction::UDiv ? Intrinsic::umul_with_overflow : Intrinsic::smul_with_overflow;
+                }
+            }
+        }
+        if (!Arith)
+            return false;
+
+        IRBuilder<> Builder(Arith);
+        CallInst *Call = Builder.CreateBinaryIntrinsic(ID, Arith->getOperand(0), Arith->getOperand(1));
+        Value *NewArith = Builder.CreateExtractValue(Call, 0);
+        Value *Overflow = Builder.CreateExtractValue(Call, 1);
+        Builder.SetInsertPoint(CmpInstr);
+        Value *NewCmp = Negated ? Builder.CreateNot(Overflow) : Overflow;
+
+        SmallVector<Value *, 4> Added = {Call, NewArith, Overflow};
+        if (NewCmp != Overflow)
+            Added.push_back(NewCmp);
+        Remarks.rewritten("OverflowCheck", CmpInstr, Added, {Arith, CmpInstr},
+                          std::string("overflow check replaced by ") + Intrinsic::getBaseName(ID).str());
+        Arith->replaceAllUsesWith(NewArith);
+        CmpInstr->replaceAllUsesWith(NewCmp);
+        InstructionsToRemove.push_back(Arith);
+        InstructionsToRemove.push_back(CmpInstr);
+        return true;
+    }
 };
 //4. All cmp instructions on boolean values are replaced with logical ops
 struct ReplaceCompareInstructionsPass : public PassInfoMixin<ReplaceCompareInstructionsPass> {
-    PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
+    static bool isRequired() { return true; }
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
         bool changed = false;
         InstructionsToRemove.clear();
-        for (auto &F : M) {
-            mapVariables(F);
-            errs() << "Old IR:\n" << F << "\n";
-            for (auto &BB : F) {
-                for(auto &I : BB) {
-                    if (auto *CmpInstr = dyn_cast<ICmpInst>(&I)) {
-                        IRBuilder<> Builder(CmpInstr);
-                        Value *LHS = CmpInstr->getOperand(0);
-                        Value *RHS = CmpInstr->getOperand(1);
-                        Value *NewInstr = nullptr;
-
-                        // errs() << "ASds" << *ValuesMap[LHS]->getType() << "\n";
-                        // Check if the comparison is on boolean values (i8) in c
-                        if (ValuesMap[LHS]->getType()->isIntegerTy(1) && ValuesMap[RHS]->getType()->isIntegerTy(1)) {
-                            // errs() << "aaa" << "\n";
-                            switch (CmpInstr->getPredicate()) {
-                            case ICmpInst::ICMP_EQ:
-                                // x == y can be replaced with !(x ^ y )
-                                NewInstr =  Builder.CreateNot(Builder.CreateXor(LHS, RHS));
-                                break;
-                            case ICmpInst::ICMP_NE:
-                                // x != y can be replaced with (x ^ y )
-                                NewInstr = Builder.CreateXor(LHS, RHS);
-                                break;
-                            default:
-                                break;
-                            }
+        CombineRemarks Remarks(F, FAM);
+        mapVariables(F);
+        errs() << "Old IR:\n" << F << "\n";
+        for (auto &BB : F) {
+            for(auto &I : BB) {
+                if (auto *CmpInstr = dyn_cast<ICmpInst>(&I)) {
+                    IRBuilder<> Builder(CmpInstr);
+                    Value *LHS = CmpInstr->getOperand(0);
+                    Value *RHS = CmpInstr->getOperand(1);
+                    Value *NewInstr = nullptr;
+
+                    // Operands that aren't loads or zexts have no entry in ValuesMap.
+                    Value *LHSSource = ValuesMap.lookup(LHS);
+                    Value *RHSSource = ValuesMap.lookup(RHS);
+                    // Check if the comparison is on boolean values (i8) in c
+                    if (LHSSource && RHSSource && LHSSource->getType()->isIntegerTy(1) && RHSSource->getType()->isIntegerTy(1)) {
+                        // The xor works on the i1 values themselves, so the result has the type of the compare.
+                        switch (CmpInstr->getPredicate()) {
+                        case ICmpInst::ICMP_EQ:
+                            // x == y can be replaced with !(x ^ y )
+                            NewInstr =  Builder.CreateNot(Builder.CreateXor(LHSSource, RHSSource));
+                            break;
+                        case ICmpInst::ICMP_NE:
+                            // x != y can be replaced with (x ^ y )
+                            NewInstr = Builder.CreateXor(LHSSource, RHSSource);
+                            break;
+                        default:
+                            break;
                         }
+                    }
 
-                        if (NewInstr) {
-                            CmpInstr->replaceAllUsesWith(NewInstr);
-                            InstructionsToRemove.push_back(CmpInstr);
-                            changed = true;
-                            // CmpInstr->eraseFromParent();
+                    if (NewInstr) {
+                        Remarks.replaced("ReplaceCompare", CmpInstr, NewInstr);
+                        CmpInstr->replaceAllUsesWith(NewInstr);
+                        InstructionsToRemove.push_back(CmpInstr);
+                        changed = true;
+                        // CmpInstr->eraseFromParent();
 
-                        }
+                    }
 
-                     }
-                }
-            }
-            for (Instruction *Instr : InstructionsToRemove) {
-                 Instr->eraseFromParent();
+                 }
             }
-
-            errs() << "New IR: \n" << F << "\n";
         }
+        eraseQueuedInstructions();
+
+        errs() << "New IR: \n" << F << "\n";
         if(changed)
             return PreservedAnalyses::none();
         return PreservedAnalyses::all();
@@ -200,34 +653,36 @@ struct ReplaceCompareInstructionsPass : public PassInfoMixin<ReplaceCompareInstr
 };
 //5. add X, X is represented as (X*2) => (X << 1)
 struct ReplaceSameOperandsAddWithShlPass : public PassInfoMixin<ReplaceSameOperandsAddWithShlPass> {
-    PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
+    static bool isRequired() { return true; }
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
         bool changed = false;
         InstructionsToRemove.clear();
-        for (auto &F : M) {
-            mapVariables(F);
-            errs() << "Old IR:\n" << F << "\n";
-            for (auto &BB : F) {
-                for(auto &I : BB) {
-                    if(BinaryOperator* BinaryOp = dyn_cast<BinaryOperator>(&I)) {
-                        IRBuilder<> Builder(&I);
-                        if(BinaryOp->getOpcode() == Instruction::Add) {
-                            if(ValuesMap[BinaryOp->getOperand(0)] == ValuesMap[BinaryOp->getOperand(1)]) {
-                                Value *shiftInstr = Builder.CreateShl(BinaryOp->getOperand(0), 1);
-                                I.replaceAllUsesWith(shiftInstr);
-                                InstructionsToRemove.push_back(&I);
-                                changed= true;
-                            }
-
+        CombineRemarks Remarks(F, FAM);
+        mapVariables(F);
+        errs() << "Old IR:\n" << F << "\n";
+        for (auto &BB : F) {
+            for(auto &I : BB) {
+                if(BinaryOperator* BinaryOp = dyn_cast<BinaryOperator>(&I)) {
+                    IRBuilder<> Builder(&I);
+                    if(BinaryOp->getOpcode() == Instruction::Add) {
+                        // Operands that aren't loads have no entry in ValuesMap, so they only match when they are the same value.
+                        Value *LHSSource = ValuesMap.lookup(BinaryOp->getOperand(0));
+                        Value *RHSSource = ValuesMap.lookup(BinaryOp->getOperand(1));
+                        if(BinaryOp->getOperand(0) == BinaryOp->getOperand(1) || (LHSSource && LHSSource == RHSSource)) {
+                            Value *shiftInstr = Builder.CreateShl(BinaryOp->getOperand(0), 1);
+                            Remarks.replaced("SameOperandsAddToShl", &I, shiftInstr);
+                            I.replaceAllUsesWith(shiftInstr);
+                            InstructionsToRemove.push_back(&I);
+                            changed= true;
                         }
+
                     }
                 }
             }
-            for (Instruction *Instr : InstructionsToRemove) {
-                 Instr->eraseFromParent();
-            }
-
-            errs() << "New IR: \n" << F << "\n";
         }
+        eraseQueuedInstructions();
+
+        errs() << "New IR: \n" << F << "\n";
         if(changed)
             return PreservedAnalyses::none();
         return PreservedAnalyses::all();
@@ -235,40 +690,39 @@ struct ReplaceSameOperandsAddWithShlPass : public PassInfoMixin<ReplaceSameOpera
 };
 //6. Multiplies with a power-of-two constant argument are transformed into shifts.
 struct ReplacePowerOfTwoMullWithShlPass : public PassInfoMixin<ReplacePowerOfTwoMullWithShlPass> {
-    PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
+    static bool isRequired() { return true; }
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
         bool changed = false;
         InstructionsToRemove.clear();
-        for (auto &F : M) {
-            mapVariables(F);
-            errs() << "Old IR:\n" << F << "\n";
-            for (auto &BB : F) {
-                for(auto &I : BB) {
-                    if(BinaryOperator* BinaryOp = dyn_cast<BinaryOperator>(&I)) {
-                        IRBuilder<> Builder(&I);
-                        if(BinaryOp->getOpcode() == Instruction::Mul) {
-                            Value *op1 = BinaryOp->getOperand(0);
-                            Value *op2 = BinaryOp->getOperand(1);
-                            if(ConstantInt *constOp = dyn_cast<ConstantInt>(op2)) {
-                                if (constOp->getValue().isPowerOf2()) {
-                                    unsigned int shiftAmount = constOp->getValue().logBase2();
-                                    Value *shiftInstr = Builder.CreateShl(op1, shiftAmount);
-                                    I.replaceAllUsesWith(shiftInstr);
-                                    InstructionsToRemove.push_back(&I);
-                                    changed = true;
-                                }
+        CombineRemarks Remarks(F, FAM);
+        mapVariables(F);
+        errs() << "Old IR:\n" << F << "\n";
+        for (auto &BB : F) {
+            for(auto &I : BB) {
+                if(BinaryOperator* BinaryOp = dyn_cast<BinaryOperator>(&I)) {
+                    IRBuilder<> Builder(&I);
+                    if(BinaryOp->getOpcode() == Instruction::Mul) {
+                        Value *op1 = BinaryOp->getOperand(0);
+                        Value *op2 = BinaryOp->getOperand(1);
+                        if(ConstantInt *constOp = dyn_cast<ConstantInt>(op2)) {
+                            if (constOp->getValue().isPowerOf2()) {
+                                unsigned int shiftAmount = constOp->getValue().logBase2();
+                                Value *shiftInstr = Builder.CreateShl(op1, shiftAmount);
+                                Remarks.replaced("PowerOfTwoMulToShl", &I, shiftInstr);
+                                I.replaceAllUsesWith(shiftInstr);
+                                InstructionsToRemove.push_back(&I);
+                                changed = true;
                             }
-
                         }
 
                     }
+
                 }
             }
-            for (Instruction *Instr : InstructionsToRemove) {
-                 Instr->eraseFromParent();
-            }
-
-            errs() << "New IR: \n" << F << "\n";
         }
+        eraseQueuedInstructions();
+
+        errs() << "New IR: \n" << F << "\n";
         if(changed)
             return PreservedAnalyses::none();
         return PreservedAnalyses::all();
@@ -279,23 +733,24 @@ struct ReplacePowerOfTwoMullWithShlPass : public PassInfoMixin<ReplacePowerOfTwo
     
 
 struct AllocaCountPass : public PassInfoMixin<AllocaCountPass> {
-    PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
-        for (auto &F : M) {
-            std::string func_name = F.getName().str();
-            // errs() << "[AllocaCountPass] Currently analyzing " << func_name << "\n";
-            for (auto &BB : F) {
-                Instruction* next_instruction = &BB.front();
-                while(true) {
-                    auto *alloca_instr = dyn_cast<AllocaInst>(next_instruction);
-                    if (alloca_instr == nullptr)
-                        break;
-                    else {
-                        AllocaCounts[func_name] += 1;
-                        next_instruction = alloca_instr->getNextNonDebugInstruction();
-                    }
+    static bool isRequired() { return true; }
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        std::string func_name = F.getName().str();
+        // errs() << "[AllocaCountPass] Currently analyzing " << func_name << "\n";
+        // The pipeline may run the rules on a function more than once, so the count starts over.
+        AllocaCounts[func_name] = 0;
+        for (auto &BB : F) {
+            Instruction* next_instruction = &BB.front();
+            while(true) {
+                auto *alloca_instr = dyn_cast<AllocaInst>(next_instruction);
+                if (alloca_instr == nullptr)
+                    break;
+                else {
+                    AllocaCounts[func_name] += 1;
+                    next_instruction = alloca_instr->getNextNonDebugInstruction();
                 }
-                break;
             }
+            break;
         }
         return PreservedAnalyses::all();
     }
@@ -304,42 +759,64 @@ struct AllocaCountPass : public PassInfoMixin<AllocaCountPass> {
 
 
 struct PatternCountPass : public PassInfoMixin<PatternCountPass> {
-    PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
-        for (auto &F : M) {
-            std::string function_name = F.getName().str();
-            for (auto &BB : F) {
-                int alloca_count = AllocaCounts[F.getName().str()];
-                int tmp_alloca_store_count = alloca_count * 2;
-                for (auto &I : BB)
-                {
-                    // Skip the alloca and store instructions:
-                    if (tmp_alloca_store_count) {
-                        tmp_alloca_store_count--;
-                        continue;
-                    }
-
-                    if (auto *load_instruction = dyn_cast<LoadInst>(&I)) {
-                        Value* load_ptr = load_instruction->getPointerOperand(); // NOTE: This should be equal to load_instruction->getOperand(0);
+    static bool isRequired() { return true; }
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        // Counts from an earlier run over this function are stale, the other functions' counts are not ours to drop.
+        // Besides its locals that covers the globals and arguments F loads from and stores to.
+        for (auto &I : instructions(F)) {
+            PatternCounts.erase(&I);
+            InitialStoredValues.erase(&I);
+            if (Value *Ptr = getLoadStorePointerOperand(&I)) {
+                PatternCounts.erase(Ptr);
+                InitialStoredValues.erase(Ptr);
+            }
+        }
+        // Increments in cold code or behind control flow are left alone, see isHotFunction and isStraightLine.
+        const char *Skipped = nullptr;
+        if (!isStraightLine(F))
+            Skipped = "not merged, the function has control flow";
+        else if (!isHotFunction(F, FAM))
+            Skipped = "not merged, the function is not hot";
+        CombineRemarks Remarks(F, FAM);
+        remarkIncrements(F, Remarks, Skipped);
+        if (Skipped)
+            return PreservedAnalyses::all();
+        std::string function_name = F.getName().str();
+        for (auto &BB : F) {
+            int alloca_count = AllocaCounts.lookup(F.getName());
+            int tmp_alloca_store_count = alloca_count * 2;
+            for (auto &I : BB)
+            {
+                // Skip the alloca and store instructions:
+                if (tmp_alloca_store_count) {
+                    tmp_alloca_store_count--;
+                    continue;
+                }
 
-                        Instruction* next_instruction = I.getNextNonDebugInstruction();
-                        if (auto *binary_op = dyn_cast<BinaryOperator>(next_instruction)) {
-                            if(binary_op->getOpcode() == Instruction::Add) {
-                                // Save the second add operand, so that we can support combining for += 2 or += <something> instead of just ++.
-                                Value* right_operand = binary_op->getOperand(1);
-                                next_instruction = next_instruction->getNextNonDebugInstruction();
-                                if (auto *store_instruction = dyn_cast<StoreInst>(next_instruction)) {
+                if (auto *load_instruction = dyn_cast<LoadInst>(&I)) {
+                    Value* load_ptr = load_instruction->getPointerOperand(); // NOTE: This should be equal to load_instruction->getOperand(0);
+                    // Only the locals AllocaCountPass counted have an initial store the increments can be merged behind.
+                    if (!isa<AllocaInst>(load_ptr))
+                        continue;
 
-                                    Value* stored_value = store_instruction->getOperand(0);
-                                    Value* ptr_to_storage = store_instruction->getOperand(1);
+                    Instruction* next_instruction = I.getNextNonDebugInstruction();
+                    if (auto *binary_op = dyn_cast<BinaryOperator>(next_instruction)) {
+                        if(binary_op->getOpcode() == Instruction::Add) {
+                            // Save the second add operand, so that we can support combining for += 2 or += <something> instead of just ++.
+                            Value* right_operand = binary_op->getOperand(1);
+                            next_instruction = next_instruction->getNextNonDebugInstruction();
+                            if (auto *store_instruction = dyn_cast<StoreInst>(next_instruction)) {
 
-                                    if (stored_value == binary_op  && ptr_to_storage == load_ptr) {
+                                Value* stored_value = store_instruction->getOperand(0);
+                                Value* ptr_to_storage = store_instruction->getOperand(1);
 
-                                        // Instead of just increasing this by 1 (which corresponds to an increment), we will increase it by the add's right operand, so we can cover += 2, += 3, etc.
-                                        if(ConstantInt* ci_right_op = dyn_cast<ConstantInt>(right_operand)) {
-                                            PatternCounts[load_ptr] += ci_right_op->getSExtValue();
-                                        }
+                                if (stored_value == binary_op  && ptr_to_storage == load_ptr) {
 
+                                    // Instead of just increasing this by 1 (which corresponds to an increment), we will increase it by the add's right operand, so we can cover += 2, += 3, etc.
+                                    if(ConstantInt* ci_right_op = dyn_cast<ConstantInt>(right_operand)) {
+                                        PatternCounts[load_ptr] += ci_right_op->getSExtValue();
                                     }
+
                                 }
                             }
                         }
@@ -349,113 +826,155 @@ struct PatternCountPass : public PassInfoMixin<PatternCountPass> {
         }
         return PreservedAnalyses::all();
     }
+
+    // Goes over every  store (add (load p), n), p  of the function and reports whether the counting above picks it
+    // up, or else why increment merging will leave it alone.
+    static void remarkIncrements(Function &F, CombineRemarks &Remarks, const char *Skipped) {
+        for (auto &BB : F) {
+            for (auto &I : BB) {
+                auto *Store = dyn_cast<StoreInst>(&I);
+                Value *Loaded = nullptr;
+                Value *Amount = nullptr;
+                if (!Store || !match(Store->getValueOperand(), m_Add(m_Value(Loaded), m_Value(Amount))))
+                    continue;
+                auto *Load = dyn_cast<LoadInst>(Loaded);
+                if (!Load || Load->getPointerOperand() != Store->getPointerOperand())
+                    continue;
+                auto *Add = cast<Instruction>(Store->getValueOperand());
+                std::string Variable = CombineRemarks::getVariableName(Store->getPointerOperand());
+
+                if (Skipped)
+                    Remarks.missed("IncrementCombining", Store, "increment of " + Variable + " " + Skipped);
+                else if (!isa<AllocaInst>(Store->getPointerOperand()))
+                    Remarks.missed("IncrementCombining", Store, "increment of " + Variable + " not merged, it is not a local");
+                else if (!isa<ConstantInt>(Amount))
+                    Remarks.missed("IncrementCombining", Store, "increment of " + Variable + " not merged, the amount is not a constant");
+                else if (Load->getNextNonDebugInstruction() != Add || Add->getNextNonDebugInstruction() != Store)
+                    Remarks.missed("IncrementCombining", Store, "increment of " + Variable +
+                                   " not merged, it is interleaved with other instructions instead of being a load, add and store in a row");
+                else
+                    Remarks.analysis("PatternCount", Store, "increment of " + Variable + " counted for merging");
+            }
+        }
+    }
 };
 
 struct IncrementInstructionCombiningPass : public PassInfoMixin<IncrementInstructionCombiningPass> {
-    PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
-
-        for (auto &F : M) {
-            errs() << "Old IR: \n" << F << "\n";
-
-            int initial_alloca_count = AllocaCounts.at(F.getName().str());
-            int initial_store_count = initial_alloca_count;
-
-            std::vector<int> initial_store_values(initial_store_count);
-            bool isMainStoreSkipped = false;
-            bool isFirstLoadSaved = false;
-            Value* new_add = nullptr;
-            Value* first_loaded_value = nullptr;
-
-            for (auto &BB : F) {
-                StoreInst* instruction_to_skip = nullptr;
-                for (auto &I : BB) {
-                    // Skip initial allocas:
-                    if (initial_alloca_count) {
-                        initial_alloca_count--;
-                        continue;
-                    }
+    static bool isRequired() { return true; }
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+
+        // Functions without locals (and declarations) have nothing to combine.
+        if (!isStraightLine(F) || !isHotFunction(F, FAM) || !AllocaCounts.count(F.getName()))
+            return PreservedAnalyses::all();
+        CombineRemarks Remarks(F, FAM);
+        errs() << "Old IR: \n" << F << "\n";
+
+        int initial_alloca_count = AllocaCounts.lookup(F.getName());
+        int initial_store_count = initial_alloca_count;
+
+        std::vector<int> initial_store_values(initial_store_count);
+        bool isMainStoreSkipped = false;
+        bool isFirstLoadSaved = false;
+        Value* new_add = nullptr;
+        Value* first_loaded_value = nullptr;
+        // The load, add and store created for the merged increments, which must not be taken for leftovers.
+        SmallPtrSet<Instruction *, 8> MergedIncrements;
+        // Variables that got a merged increment after their initial store. Only their old increments may go away.
+        SmallPtrSet<Value *, 8> MergedPointers;
+
+        for (auto &BB : F) {
+            StoreInst* instruction_to_skip = nullptr;
+            for (auto &I : BB) {
+                // Skip initial allocas:
+                if (initial_alloca_count) {
+                    initial_alloca_count--;
+                    continue;
+                }
 
-                    // NOTE: Specially for main(), there is an additional store (always the first store coming after allocas) that we want to skip
-                    if (F.getName().str() == "main" && !isMainStoreSkipped) {
-                        isMainStoreSkipped = true;
-                        initial_store_count--;
-                        continue;
-                    }
+                // NOTE: Specially for main(), there is an additional store (always the first store coming after allocas) that we want to skip
+                if (F.getName().str() == "main" && !isMainStoreSkipped) {
+                    isMainStoreSkipped = true;
+                    initial_store_count--;
+                    continue;
+                }
 
-                    if(initial_store_count > 0) {
-                        if (auto *store_instruction = dyn_cast<StoreInst>(&I)) {
-                            // We need a way to skip our custom stores that we added in here, so that they don't trigger the if when I becomes that new store instruction.
-                            if (store_instruction != instruction_to_skip) {
+                if(initial_store_count > 0) {
+                    if (auto *store_instruction = dyn_cast<StoreInst>(&I)) {
+                        // We need a way to skip our custom stores that we added in here, so that they don't trigger the if when I becomes that new store instruction.
+                        if (store_instruction != instruction_to_skip) {
 
-                                Value* stored_value = store_instruction->getValueOperand();
-                                Value* ptr_to_storage = store_instruction->getPointerOperand();
+                            Value* stored_value = store_instruction->getValueOperand();
+                            Value* ptr_to_storage = store_instruction->getPointerOperand();
 
+                            // Variables that are never incremented keep their store as it is.
+                            if (PatternCounts.count(ptr_to_storage)) {
                                 // Create the load instruction that loads the stored value and then our custom add instruction for that variable.
                                 // After that, store that at the original location.
                                 IRBuilder<> builder(store_instruction);
                                 builder.SetInsertPoint(&BB, ++builder.GetInsertPoint());
                                 LoadInst* new_load_inst = builder.CreateLoad(stored_value->getType(), ptr_to_storage);
-                                Value* new_add_inst = builder.CreateAdd(new_load_inst, ConstantInt::get(stored_value->getType(), PatternCounts.at(new_load_inst->getPointerOperand())));
+                                Value* new_add_inst = builder.CreateAdd(new_load_inst, ConstantInt::get(stored_value->getType(), PatternCounts.lookup(new_load_inst->getPointerOperand())));
 
 
                                 // We can't just simply add the store instruction like we added load and add, because when I becomes this new store instruction, it will enter the if, and we don't want that for out custom store instructions.
                                 // We need a way to skip our custom stores
                                 StoreInst* new_store_inst = builder.CreateStore(new_add_inst, ptr_to_storage);
                                 instruction_to_skip = new_store_inst;
-
-                                initial_store_count--;
+                                MergedIncrements.insert({new_load_inst, cast<Instruction>(new_add_inst), new_store_inst});
+                                MergedPointers.insert(ptr_to_storage);
+                                Remarks.rewritten("IncrementCombining", new_store_inst, {new_load_inst, new_add_inst, new_store_inst}, {},
+                                                  "increments of " + CombineRemarks::getVariableName(ptr_to_storage) + " merged into one add of " +
+                                                  std::to_string(PatternCounts.lookup(ptr_to_storage)));
                             }
-                        }
-                        continue;
-                    }
 
-                    if(initial_store_count > -3) {
-                        initial_store_count--;
-                        // If we encounter a return instruction here, we stop in order to prevent a segfault:
-                        if (auto* ret_inst = dyn_cast<ReturnInst>(&I)) {
-                            errs() << "New IR: \n" << F << "\n";
-                            return PreservedAnalyses::none();
-                        } else
-                            continue;
+                            initial_store_count--;
+                        }
                     }
+                    continue;
+                }
 
-                   
-
-                    // We just want to remove load-store-adds that are leftover from original code, not all instructions that come after our newly added ones.
-                    if (auto* pattern_load = dyn_cast<LoadInst>(&I)) {
-                        // errs() << "Pattern load to remove: " << *pattern_load << "\n";
-                        Instruction* next_instruction = pattern_load->getNextNonDebugInstruction();
-                        if (auto* bin_op = dyn_cast<BinaryOperator>(next_instruction)) {
-                            if (bin_op->getOpcode() == Instruction::Add) {
-                                // errs() << "Pattern add to remove: " << *bin_op << "\n";
-                                next_instruction = bin_op->getNextNonDebugInstruction();
-                                if (auto* pattern_store = dyn_cast<StoreInst>(next_instruction)) {
-                                    // errs() << "Pattern store to remove: " << *pattern_store << "\n";
-                                    InstructionsToRemove.push_back(pattern_store);
-                                    InstructionsToRemove.push_back(bin_op);
-                                    InstructionsToRemove.push_back(pattern_load);
-                                }
+                // We just want to remove load-store-adds that are leftover from original code, not all instructions that come after our newly added ones.
+                // The merged increment is not always right before them: it follows the variable's own initial store.
+                if (MergedIncrements.count(&I))
+                    continue;
+                if (auto* pattern_load = dyn_cast<LoadInst>(&I)) {
+                    // errs() << "Pattern load to remove: " << *pattern_load << "\n";
+                    Instruction* next_instruction = pattern_load->getNextNonDebugInstruction();
+                    if (auto* bin_op = dyn_cast<BinaryOperator>(next_instruction)) {
+                        // Only the increments PatternCountPass counted were merged: the add works on the loaded value,
+                        // adds a constant, and the sum goes back to a variable that got a merged increment above.
+                        if (bin_op->getOpcode() == Instruction::Add && bin_op->getOperand(0) == pattern_load &&
+                            isa<ConstantInt>(bin_op->getOperand(1)) && MergedPointers.count(pattern_load->getPointerOperand())) {
+                            // errs() << "Pattern add to remove: " << *bin_op << "\n";
+                            next_instruction = bin_op->getNextNonDebugInstruction();
+                            auto* pattern_store = dyn_cast<StoreInst>(next_instruction);
+                            if (pattern_store && pattern_store->getValueOperand() == bin_op &&
+                                pattern_store->getPointerOperand() == pattern_load->getPointerOperand()) {
+                                // errs() << "Pattern store to remove: " << *pattern_store << "\n";
+                                Remarks.rewritten("IncrementCombining", pattern_store, {}, {pattern_store, bin_op, pattern_load},
+                                                  "increment of " + CombineRemarks::getVariableName(pattern_store->getPointerOperand()) + " folded into the merged add");
+                                InstructionsToRemove.push_back(pattern_store);
+                                InstructionsToRemove.push_back(bin_op);
+                                InstructionsToRemove.push_back(pattern_load);
                             }
                         }
-                    } 
-                }
-
-
-                // Finally, we erase all the instructions that are queued for erasure:
-                for (Instruction* instr : InstructionsToRemove) {
-                    instr->eraseFromParent();
-                }
+                    }
+                } 
             }
-            // Print tne new IR
-            errs() << "New IR: \n" << F << "\n";
 
-            // Verify that it is valid IR.
-            if (verifyFunction(F, &errs()))
-                errs() << "Function " << F.getName() << " is invalid!\n";
-            else
-                errs() << "Function " << F.getName() << " is valid!\n";
 
+            // Finally, we erase all the instructions that are queued for erasure:
+            eraseQueuedInstructions();
         }
+        // Print tne new IR
+        errs() << "New IR: \n" << F << "\n";
+
+        // Verify that it is valid IR.
+        if (verifyFunction(F, &errs()))
+            errs() << "Function " << F.getName() << " is invalid!\n";
+        else
+            errs() << "Function " << F.getName() << " is valid!\n";
+
 
         InstructionsToRemove.clear();
         return PreservedAnalyses::none();
@@ -477,114 +996,1528 @@ struct IncrementInstructionCombiningPass : public PassInfoMixin<IncrementInstruc
 **
  */
 struct InitStoreCombiningPass : public PassInfoMixin<InitStoreCombiningPass> {
-    PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
+    static bool isRequired() { return true; }
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+
+        if (!isStraightLine(F) || !isHotFunction(F, FAM) || !AllocaCounts.count(F.getName()))
+            return PreservedAnalyses::all();
+
+        CombineRemarks Remarks(F, FAM);
+        errs() << "Old IR: " << F << "\n";
+        int initial_alloca_count = AllocaCounts.lookup(F.getName());
+        bool isMainStoreSkipped = false;
+        bool isStoreInstToSkip = false;
+        // Variables whose initial store now carries the increments. Only their increments may go away,
+        // a variable initialised from a parameter still needs its (already merged) increment.
+        SmallPtrSet<Value *, 8> FoldedPointers;
+
+        for (auto &BB : F) {
+            for (auto &I : BB) {
+                // Skip the initial alloca instructions and that specific main store instruction if we are in main:
+                if (initial_alloca_count) {
+                    initial_alloca_count--;
+                    continue;
+                }
 
-        for (auto &F : M) {
+                if (F.getName().str() == "main" && !isMainStoreSkipped) {
+                    isMainStoreSkipped = true;
+                    // initial_store_count--;
+                    continue;
+                }
 
-            errs() << "Old IR: " << F << "\n";
-            int initial_alloca_count = AllocaCounts.at(F.getName().str());
-            bool isMainStoreSkipped = false;
-            bool isStoreInstToSkip = false;
 
-            for (auto &BB : F) {
-                for (auto &I : BB) {
-                    // Skip the initial alloca instructions and that specific main store instruction if we are in main:
-                    if (initial_alloca_count) {
-                        initial_alloca_count--;
+                // First, we see at what store inst are we now:
+                if(auto* current_store_inst = dyn_cast<StoreInst>(&I)) {
+                    // We don't want to do this if we are currently at the previously newly created store inst:
+                    if(!isStoreInstToSkip) {
+
+                        // We need to store the initial stored value, because of the following case:
+                        /**
+                         *    int x = 5;
+                         *    x += 3;
+                         *
+                         *    This should be int x = 8;
+                         *    If we don't remember the initial stored value, we would just overwrite it with 3.
+                         */
+                        Value* stored_value = current_store_inst->getValueOperand();
+                        Value* ptr_to_storage = current_store_inst->getPointerOperand();
+                        // Only a constant initial value of a variable that is incremented later can be folded.
+                        if (!isa<ConstantInt>(stored_value) || !PatternCounts.count(ptr_to_storage))
+                            continue;
+                        InitialStoredValues[ptr_to_storage] = cast<ConstantInt>(stored_value)->getSExtValue();
+
+                        // We schedule this initial store for deletion:
+                        InstructionsToRemove.push_back(current_store_inst);
+
+                        IRBuilder<> builder (current_store_inst);
+                        builder.SetInsertPoint(&BB, ++builder.GetInsertPoint());
+
+                        Value* ci_value = ConstantInt::get(current_store_inst->getValueOperand()->getType(), InitialStoredValues.lookup(ptr_to_storage) + PatternCounts.lookup(ptr_to_storage));
+                        StoreInst* new_store_inst = builder.CreateStore(ci_value, ptr_to_storage);
+                        FoldedPointers.insert(ptr_to_storage);
+                        isStoreInstToSkip = true;
+                        Remarks.rewritten("InitStoreCombining", new_store_inst, {new_store_inst}, {current_store_inst},
+                                          "increments of " + CombineRemarks::getVariableName(ptr_to_storage) + " folded into its initial value");
+
                         continue;
+                    } else {
+                        // Reset;
+                        isStoreInstToSkip = false;
                     }
+                } else if (auto* current_load_inst = dyn_cast<LoadInst>(&I)) {
+                   // This means that we passed all store instructions
+                   // Now we check for the pattern and delete those load-add-store instructions,
+                   // but ONLY if they correspond to x++; or x += <something>.
+                   Value* load_ptr = current_load_inst->getPointerOperand();
+                   Instruction* next_instruction = I.getNextNonDebugInstruction();
+                   if (auto *binary_op = dyn_cast<BinaryOperator>(next_instruction)) {
+                        if(binary_op->getOpcode() == Instruction::Add) {
+                            next_instruction = next_instruction->getNextNonDebugInstruction();
+
+                            if (auto *store_instruction = dyn_cast<StoreInst>(next_instruction)) {
+
+                                // Important: We want to skip this one, like the ones we created,
+                                // in order not to trigger the if above (which should only trigger for initial stores)
+                                isStoreInstToSkip = true;
+
+                                Value* stored_value = store_instruction->getOperand(0);
+                                Value* ptr_to_storage = store_instruction->getOperand(1);
+
+                                if (stored_value == binary_op  && ptr_to_storage == load_ptr && binary_op->getOperand(0) == current_load_inst &&
+                                    isa<ConstantInt>(binary_op->getOperand(1)) && FoldedPointers.count(ptr_to_storage)) {
+                                    Remarks.rewritten("InitStoreCombining", store_instruction, {}, {store_instruction, binary_op, current_load_inst},
+                                                      "increment of " + CombineRemarks::getVariableName(ptr_to_storage) + " folded into its initial value");
+                                    InstructionsToRemove.push_back(store_instruction);
+                                    InstructionsToRemove.push_back(binary_op);
+                                    InstructionsToRemove.push_back(current_load_inst);
+                                }
+                            }
+                        }
+                   }
+                }
+            }
+
+            eraseQueuedInstructions();
+        }
+
+        errs() << "New IR: " << F << "\n";
+        // Verify that it is valid IR.
+        if (verifyFunction(F, &errs()))
+            errs() << "Function " << F.getName() << " is invalid!\n";
+        else
+            errs() << "Function " << F.getName() << " is valid!\n";
+
+
+        InstructionsToRemove.clear();
+        return PreservedAnalyses::none();
+    }
+};
+
+// Neighbouring stores off a common base:   s.a = 1; s.b = 2; s.c = 3; s.d = 4;   -------> one i32/i64/vector store
+/*
+** A run is a sequence of stores in one block, each starting right where the previous one ended.
+** The run is broken by anything that may touch the stored object in between.
+** Runs of constants become a single constant store, runs of values loaded from another (non aliasing)
+** object at the same relative offsets become one wide load followed by one wide store.
+ */
+struct StoreMergingPass : public PassInfoMixin<StoreMergingPass> {
+    static bool isRequired() { return true; }
+    struct StoreSlot {
+        StoreInst *Store;
+        int64_t Offset;
+        uint64_t Size;
+    };
 
-                    if (F.getName().str() == "main" && !isMainStoreSkipped) {
-                        isMainStoreSkipped = true;
-                        // initial_store_count--;
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        bool changed = false;
+        InstructionsToRemove.clear();
+        const DataLayout &DL = F.getParent()->getDataLayout();
+        CombineRemarks Remarks(F, FAM);
+        auto &TTI = FAM.getResult<TargetIRAnalysis>(F);
+        for (auto &BB : F) {
+            if (!isHotBlock(BB, FAM))
+                continue;
+            std::vector<StoreSlot> Run;
+            Value *RunBase = nullptr;
+            for (auto &I : BB) {
+                if (auto *Store = dyn_cast<StoreInst>(&I)) {
+                    int64_t Offset = 0;
+                    Value *Base = getStoreBase(Store, Offset, DL);
+                    uint64_t Size = DL.getTypeStoreSize(Store->getValueOperand()->getType());
+                    if (Base && Base == RunBase && Offset == Run.back().Offset + (int64_t) Run.back().Size) {
+                        Run.push_back({Store, Offset, Size});
                         continue;
                     }
+                    changed |= mergeRun(Run, DL, TTI, Remarks);
+                    Run.clear();
+                    RunBase = Base;
+                    if (Base)
+                        Run.push_back({Store, Offset, Size});
+                    continue;
+                }
+                // Loads from other objects are what feeds a copy, they don't end the run.
+                if (auto *Load = dyn_cast<LoadInst>(&I)) {
+                    if (Load->isSimple() && isDistinctObject(Load->getPointerOperand(), RunBase))
+                        continue;
+                }
+                if (I.mayReadOrWriteMemory()) {
+                    changed |= mergeRun(Run, DL, TTI, Remarks);
+                    Run.clear();
+                    RunBase = nullptr;
+                }
+            }
+            changed |= mergeRun(Run, DL, TTI, Remarks);
+        }
+        eraseQueuedInstructions();
+        if(changed)
+            return PreservedAnalyses::none();
+        return PreservedAnalyses::all();
+    }
 
+    // Only simple stores of whole-byte integers take part in merging.
+    static Value *getStoreBase(StoreInst *Store, int64_t &Offset, const DataLayout &DL) {
+        Type *Ty = Store->getValueOperand()->getType();
+        if (!Store->isSimple() || !Ty->isIntegerTy())
+            return nullptr;
+        if (DL.getTypeSizeInBits(Ty) != DL.getTypeStoreSizeInBits(Ty))
+            return nullptr;
+        return GetPointerBaseWithConstantOffset(Store->getPointerOperand(), Offset, DL);
+    }
 
-                    // First, we see at what store inst are we now:
-                    if(auto* current_store_inst = dyn_cast<StoreInst>(&I)) {
-                        // We don't want to do this if we are currently at the previously newly created store inst:
-                        if(!isStoreInstToSkip) {
-
-                            // We schedule this initial store for deletion:
-                            InstructionsToRemove.push_back(current_store_inst);
-
-                            // We need to store the initial stored value, because of the following case:
-                            /**
-                             *    int x = 5;
-                             *    x += 3;
-                             *
-                             *    This should be int x = 8;
-                             *    If we don't remember the initial stored value, we would just overwrite it with 3.
-                             */
-                            Value* stored_value = current_store_inst->getValueOperand();
-                            Value* ptr_to_storage = current_store_inst->getPointerOperand();
-                            if (ConstantInt* ci_stored_value = dyn_cast<ConstantInt>(stored_value)) {
-                                InitialStoredValues[ptr_to_storage] = ci_stored_value->getSExtValue();
-                            }
+    static bool isDistinctObject(Value *Ptr, Value *Base) {
+        if (!Base)
+            return true;
+        Value *Object = getUnderlyingObject(Ptr);
+        Value *BaseObject = getUnderlyingObject(Base);
+        return Object != BaseObject && isIdentifiedObject(Object) && isIdentifiedObject(BaseObject);
+    }
 
-                            IRBuilder<> builder (current_store_inst);
-                            builder.SetInsertPoint(&BB, ++builder.GetInsertPoint());
+    // Picks the wide type for a chunk: a legal integer if there is one, otherwise a vector that fits a register.
+    static Type *getWideType(ArrayRef<StoreSlot> Chunk, const DataLayout &DL, const TargetTransformInfo &TTI) {
+        uint64_t Bytes = Chunk.back().Offset + Chunk.back().Size - Chunk.front().Offset;
+        if (!isPowerOf2_64(Bytes))
+            return nullptr;
+        LLVMContext &Ctx = Chunk.front().Store->getContext();
+        if (DL.isLegalInteger(Bytes * 8))
+            return IntegerType::get(Ctx, Bytes * 8);
+
+        Type *ElemTy = Chunk.front().Store->getValueOperand()->getType();
+        for (const StoreSlot &Slot : Chunk) {
+            if (Slot.Store->getValueOperand()->getType() != ElemTy)
+                return nullptr;
+        }
+        uint64_t VectorBits = TTI.getRegisterBitWidth(TargetTransformInfo::RGK_FixedWidthVector).getFixedSize();
+        if (Bytes * 8 > VectorBits)
+            return nullptr;
+        return FixedVectorType::get(ElemTy, Chunk.size());
+    }
 
-                            Value* ci_value = ConstantInt::get(current_store_inst->getValueOperand()->getType(), InitialStoredValues.at(ptr_to_storage) + PatternCounts.at(ptr_to_storage));
-                            StoreInst* new_store_inst = builder.CreateStore(ci_value, ptr_to_storage);
-                            isStoreInstToSkip = true;
+    static Constant *getWideConstant(ArrayRef<StoreSlot> Chunk, Type *WideTy, const DataLayout &DL) {
+        if (isa<FixedVectorType>(WideTy)) {
+            std::vector<Constant *> Elements;
+            for (const StoreSlot &Slot : Chunk) {
+                Elements.push_back(cast<Constant>(Slot.Store->getValueOperand()));
+            }
+            return ConstantVector::get(Elements);
+        }
+        unsigned Bits = WideTy->getIntegerBitWidth();
+        APInt Wide(Bits, 0);
+        for (const StoreSlot &Slot : Chunk) {
+            APInt Value = cast<ConstantInt>(Slot.Store->getValueOperand())->getValue().zext(Bits);
+            unsigned Shift = (Slot.Offset - Chunk.front().Offset) * 8;
+            if (DL.isBigEndian())
+                Shift = Bits - Shift - Slot.Size * 8;
+            Wide |= Value.shl(Shift);
+        }
+        return ConstantInt::get(WideTy, Wide);
+    }
 
-                            continue;
-                        } else {
-                            // Reset;
-                            isStoreInstToSkip = false;
-                        }
-                    } else if (auto* current_load_inst = dyn_cast<LoadInst>(&I)) {
-                       // This means that we passed all store instructions
-                       // Now we check for the pattern and delete those load-add-store instructions,
-                       // but ONLY if they correspond to x++; or x += <something>.
-                       Value* load_ptr = current_load_inst->getPointerOperand();
-                       Instruction* next_instruction = I.getNextNonDebugInstruction();
-                       if (auto *binary_op = dyn_cast<BinaryOperator>(next_instruction)) {
-                            if(binary_op->getOpcode() == Instruction::Add) {
-                                next_instruction = next_instruction->getNextNonDebugInstruction();
-
-                                if (auto *store_instruction = dyn_cast<StoreInst>(next_instruction)) {
-
-                                    // Important: We want to skip this one, like the ones we created,
-                                    // in order not to trigger the if above (which should only trigger for initial stores)
-                                    isStoreInstToSkip = true;
-
-                                    Value* stored_value = store_instruction->getOperand(0);
-                                    Value* ptr_to_storage = store_instruction->getOperand(1);
-
-                                    if (stored_value == binary_op  && ptr_to_storage == load_ptr) {
-                                        InstructionsToRemove.push_back(store_instruction);
-                                        InstructionsToRemove.push_back(binary_op);
-                                        InstructionsToRemove.push_back(current_load_inst);
-                                    }
-                                }
-                            }
-                       }
+    // For a copy chunk, returns the first load if every stored value is a single-use load from one other
+    // object, at the same relative offsets as the stores, with nothing writing memory since the first load.
+    static LoadInst *getCopySource(ArrayRef<StoreSlot> Chunk, const DataLayout &DL) {
+        LoadInst *First = nullptr;
+        int64_t FirstOffset = 0;
+        Value *SrcBase = nullptr;
+        for (const StoreSlot &Slot : Chunk) {
+            auto *Load = dyn_cast<LoadInst>(Slot.Store->getValueOperand());
+            if (!Load || !Load->isSimple() || !Load->hasOneUse() || Load->getParent() != Slot.Store->getParent())
+                return nullptr;
+            int64_t Offset = 0;
+            Value *Base = GetPointerBaseWithConstantOffset(Load->getPointerOperand(), Offset, DL);
+            if (!First) {
+                First = Load;
+                FirstOffset = Offset;
+                SrcBase = Base;
+            } else if (Base != SrcBase || Offset - FirstOffset != Slot.Offset - Chunk.front().Offset) {
+                return nullptr;
+            }
+        }
+        if (!isDistinctObject(SrcBase, Chunk.front().Store->getPointerOperand()))
+            return nullptr;
+
+        Instruction *Earliest = First;
+        for (const StoreSlot &Slot : Chunk) {
+            auto *Load = cast<LoadInst>(Slot.Store->getValueOperand());
+            if (Load->comesBefore(Earliest))
+                Earliest = Load;
+        }
+        for (Instruction *I = Earliest; I != Chunk.back().Store; I = I->getNextNode()) {
+            if (I->mayWriteToMemory() && !isa<StoreInst>(I))
+                return nullptr;
+            if (auto *Store = dyn_cast<StoreInst>(I)) {
+                if (!isDistinctObject(Store->getPointerOperand(), SrcBase))
+                    return nullptr;
+            }
+        }
+        return First;
+    }
+
+    bool mergeRun(ArrayRef<StoreSlot> Run, const DataLayout &DL, const TargetTransformInfo &TTI, CombineRemarks &Remarks) {
+        bool changed = false;
+        size_t Start = 0;
+        while (Run.size() - Start >= 2) {
+            size_t Length = Run.size() - Start;
+            for (; Length >= 2; --Length) {
+                if (mergeChunk(Run.slice(Start, Length), DL, TTI, Remarks))
+                    break;
+            }
+            if (Length >= 2) {
+                changed = true;
+                Start += Length;
+            } else {
+                Start++;
+            }
+        }
+        return changed;
+    }
+
+    bool mergeChunk(ArrayRef<StoreSlot> Chunk, const DataLayout &DL, const TargetTransformInfo &TTI, CombineRemarks &Remarks) {
+        Type *WideTy = getWideType(Chunk, DL, TTI);
+        if (!WideTy)
+            return false;
+        StoreInst *First = Chunk.front().Store;
+        unsigned AddrSpace = First->getPointerAddressSpace();
+        if (!isFastAccess(WideTy, First->getAlign(), AddrSpace, DL, TTI))
+            return false;
+
+        bool AllConstant = true;
+        for (const StoreSlot &Slot : Chunk) {
+            AllConstant &= isa<ConstantInt>(Slot.Store->getValueOperand());
+        }
+        LoadInst *FirstLoad = AllConstant ? nullptr : getCopySource(Chunk, DL);
+        if (!AllConstant && !FirstLoad)
+            return false;
+        if (FirstLoad && !isFastAccess(WideTy, FirstLoad->getAlign(), FirstLoad->getPointerAddressSpace(), DL, TTI))
+            return false;
+
+        IRBuilder<> Builder(Chunk.back().Store);
+        Value *WideValue = nullptr;
+        if (AllConstant) {
+            WideValue = getWideConstant(Chunk, WideTy, DL);
+        } else {
+            Value *SrcPtr = Builder.CreateBitCast(FirstLoad->getPointerOperand(), WideTy->getPointerTo(FirstLoad->getPointerAddressSpace()));
+            WideValue = Builder.CreateAlignedLoad(WideTy, SrcPtr, FirstLoad->getAlign());
+        }
+        Value *DstPtr = Builder.CreateBitCast(First->getPointerOperand(), WideTy->getPointerTo(AddrSpace));
+        StoreInst *WideStore = Builder.CreateAlignedStore(WideValue, DstPtr, First->getAlign());
+
+        SmallVector<Instruction *, 8> Narrow;
+        for (const StoreSlot &Slot : Chunk) {
+            Narrow.push_back(Slot.Store);
+            if (auto *NarrowLoad = dyn_cast<LoadInst>(Slot.Store->getValueOperand()))
+                Narrow.push_back(NarrowLoad);
+        }
+        Remarks.rewritten("StoreMerging", WideStore, {WideValue, DstPtr, WideStore}, Narrow,
+                          (Twine(Chunk.size()) + " stores merged into one " + Twine(DL.getTypeStoreSize(WideTy)) + "-byte store").str());
+
+        // The narrow loads of a copy die with the stores.
+        for (const StoreSlot &Slot : Chunk) {
+            InstructionsToRemove.push_back(Slot.Store);
+        }
+        return true;
+    }
+};
+
+// Byte-wise reads:   p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24   -------> one i32 load (+ llvm.bswap for the other byte order)
+/*
+** The or-tree is flattened into its leaves, each leaf being (shl (zext (load)), C) with the shl and zext optional.
+** The leaves have to cover the whole result exactly, come from consecutive addresses off one base
+** and be placed either in memory order (plain wide load) or in reversed byte order (wide load + bswap).
+ */
+struct LoadCombiningPass : public PassInfoMixin<LoadCombiningPass> {
+    static bool isRequired() { return true; }
+    struct LoadLeaf {
+        LoadInst *Load;
+        uint64_t Shift;
+        int64_t Offset;
+    };
+
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        bool changed = false;
+        InstructionsToRemove.clear();
+        const DataLayout &DL = F.getParent()->getDataLayout();
+        CombineRemarks Remarks(F, FAM);
+        auto &TTI = FAM.getResult<TargetIRAnalysis>(F);
+        for (auto &BB : F) {
+            if (!isHotBlock(BB, FAM))
+                continue;
+            for (auto &I : BB) {
+                BinaryOperator *BinaryOp = dyn_cast<BinaryOperator>(&I);
+                if (!BinaryOp || BinaryOp->getOpcode() != Instruction::Or || !BinaryOp->getType()->isIntegerTy())
+                    continue;
+                if (Value *WideLoad = combineLoads(BinaryOp, DL, TTI)) {
+                    Remarks.replaced("LoadCombining", BinaryOp, WideLoad);
+                    BinaryOp->replaceAllUsesWith(WideLoad);
+                    InstructionsToRemove.push_back(BinaryOp);
+                    changed = true;
+                }
+            }
+        }
+        eraseQueuedInstructions();
+        if(changed)
+            return PreservedAnalyses::none();
+        return PreservedAnalyses::all();
+    }
+
+    static void collectLeaves(Value *V, Instruction *Root, std::vector<Value *> &Leaves) {
+        auto *BinaryOp = dyn_cast<BinaryOperator>(V);
+        if (BinaryOp && BinaryOp->getOpcode() == Instruction::Or && (BinaryOp == Root || BinaryOp->hasOneUse())) {
+            collectLeaves(BinaryOp->getOperand(0), Root, Leaves);
+            collectLeaves(BinaryOp->getOperand(1), Root, Leaves);
+            return;
+        }
+        Leaves.push_back(V);
+    }
+
+    static bool parseLeaf(Value *V, LoadLeaf &Leaf) {
+        Leaf.Shift = 0;
+        if (auto *Shl = dyn_cast<BinaryOperator>(V)) {
+            auto *Amount = dyn_cast<ConstantInt>(Shl->getOperand(1));
+            if (Shl->getOpcode() != Instruction::Shl || !Amount || !Shl->hasOneUse())
+                return false;
+            Leaf.Shift = Amount->getZExtValue();
+            V = Shl->getOperand(0);
+        }
+        if (auto *ZExt = dyn_cast<ZExtInst>(V)) {
+            if (!ZExt->hasOneUse())
+                return false;
+            V = ZExt->getOperand(0);
+        }
+        Leaf.Load = dyn_cast<LoadInst>(V);
+        return Leaf.Load && Leaf.Load->isSimple() && Leaf.Load->hasOneUse();
+    }
+
+    Value *combineLoads(BinaryOperator *Root, const DataLayout &DL, const TargetTransformInfo &TTI) {
+        std::vector<Value *> Values;
+        collectLeaves(Root, Root, Values);
+
+        unsigned Bits = Root->getType()->getIntegerBitWidth();
+        if (Values.size() < 2 || !DL.isLegalInteger(Bits))
+            return nullptr;
+
+        std::vector<LoadLeaf> Leaves(Values.size());
+        Value *Base = nullptr;
+        for (size_t i = 0; i < Values.size(); i++) {
+            LoadLeaf &Leaf = Leaves[i];
+            if (!parseLeaf(Values[i], Leaf) || Leaf.Load->getParent() != Root->getParent())
+                return nullptr;
+            Value *LeafBase = GetPointerBaseWithConstantOffset(Leaf.Load->getPointerOperand(), Leaf.Offset, DL);
+            if (Base && !isSameLoadedValue(Base, LeafBase))
+                return nullptr;
+            Base = LeafBase;
+        }
+
+        unsigned LeafBits = Leaves.front().Load->getType()->getPrimitiveSizeInBits();
+        if (LeafBits % 8 || LeafBits * Leaves.size() != Bits)
+            return nullptr;
+        std::sort(Leaves.begin(), Leaves.end(), [](const LoadLeaf &A, const LoadLeaf &B) { return A.Offset < B.Offset; });
+
+        // InMemoryOrder: the lowest address holds the least significant part, as in a little-endian load.
+        bool InMemoryOrder = true;
+        bool InReverseOrder = LeafBits == 8;
+        for (size_t i = 0; i < Leaves.size(); i++) {
+            if (Leaves[i].Load->getType()->getPrimitiveSizeInBits() != LeafBits)
+                return nullptr;
+            if (Leaves[i].Offset != Leaves.front().Offset + (int64_t) (i * LeafBits / 8))
+                return nullptr;
+            InMemoryOrder &= Leaves[i].Shift == i * LeafBits;
+            InReverseOrder &= Leaves[i].Shift == (Leaves.size() - 1 - i) * LeafBits;
+        }
+        if (!InMemoryOrder && !InReverseOrder)
+            return nullptr;
+
+        // The wide load is placed at the root, so nothing may write memory after the first narrow load.
+        Instruction *Earliest = Root;
+        for (const LoadLeaf &Leaf : Leaves) {
+            if (Leaf.Load->comesBefore(Earliest))
+                Earliest = Leaf.Load;
+        }
+        for (Instruction *I = Earliest; I != Root; I = I->getNextNode()) {
+            if (I->mayWriteToMemory())
+                return nullptr;
+        }
+
+        LoadInst *First = Leaves.front().Load;
+        Type *WideTy = Root->getType();
+        if (!isFastAccess(WideTy, First->getAlign(), First->getPointerAddressSpace(), DL, TTI))
+            return nullptr;
+
+        IRBuilder<> Builder(Root);
+        Value *Ptr = Builder.CreateBitCast(First->getPointerOperand(), WideTy->getPointerTo(First->getPointerAddressSpace()));
+        Value *WideLoad = Builder.CreateAlignedLoad(WideTy, Ptr, First->getAlign());
+        if (InMemoryOrder != DL.isLittleEndian())
+            WideLoad = Builder.CreateUnaryIntrinsic(Intrinsic::bswap, WideLoad);
+        return WideLoad;
+    }
+};
+
+// Cast chains:   zext(zext x), trunc(zext x), icmp (zext a), (zext b), and (zext a), (zext b), ...   -------> the narrow form
+/*
+** Boolean lowering in C leaves i1 -> i8 -> i32 round trips everywhere (see mapVariables, which looks through them).
+** Casts of casts are collapsed, and compares and bitwise operations on extended values are done in the
+** narrow type, so what is left is the computation itself plus at most one cast at the end.
+** Every rewrite can expose the next one, so the function is swept until nothing changes.
+ */
+struct CastFoldingPass : public PassInfoMixin<CastFoldingPass> {
+    static bool isRequired() { return true; }
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        bool changed = false;
+        InstructionsToRemove.clear();
+        CombineRemarks Remarks(F, FAM);
+        bool sweepChanged = true;
+        while (sweepChanged) {
+            sweepChanged = false;
+            for (auto &BB : F) {
+                if (!isHotBlock(BB, FAM))
+                    continue;
+                for (auto &I : BB) {
+                    IRBuilder<> Builder(&I);
+                    Value *NewInstr = nullptr;
+                    if (auto *Cast = dyn_cast<CastInst>(&I))
+                        NewInstr = foldCastOfCast(Cast, Builder);
+                    else if (auto *CmpInstr = dyn_cast<ICmpInst>(&I))
+                        NewInstr = foldCompare(CmpInstr, Builder);
+                    else if (auto *BinaryOp = dyn_cast<BinaryOperator>(&I))
+                        NewInstr = foldBitwise(BinaryOp, Builder);
+
+                    if (NewInstr) {
+                        Remarks.replaced("CastFolding", &I, NewInstr);
+                        I.replaceAllUsesWith(NewInstr);
+                        InstructionsToRemove.push_back(&I);
+                        sweepChanged = true;
+                    }
+                }
+            }
+            eraseQueuedInstructions();
+            changed |= sweepChanged;
+        }
+        if(changed)
+            return PreservedAnalyses::none();
+        return PreservedAnalyses::all();
+    }
+
+    static bool isExtension(Value *V) {
+        return isa<ZExtInst>(V) || isa<SExtInst>(V);
+    }
+
+    // zext(zext x), sext(sext x), sext(zext x), trunc(trunc x), trunc(zext x), trunc(sext x)
+    static Value *foldCastOfCast(CastInst *Cast, IRBuilder<> &Builder) {
+        auto *Inner = dyn_cast<CastInst>(Cast->getOperand(0));
+        if (!Inner || !Inner->getType()->isIntegerTy())
+            return nullptr;
+        Value *X = Inner->getOperand(0);
+        Type *DestTy = Cast->getType();
+        unsigned SrcBits = X->getType()->getScalarSizeInBits();
+        unsigned DestBits = DestTy->getScalarSizeInBits();
+
+        switch (Cast->getOpcode()) {
+            case Instruction::ZExt:
+                if (isa<ZExtInst>(Inner))
+                    return Builder.CreateZExt(X, DestTy);
+                break;
+            case Instruction::SExt:
+                if (isa<SExtInst>(Inner))
+                    return Builder.CreateSExt(X, DestTy);
+                if (isa<ZExtInst>(Inner))
+                    return Builder.CreateZExt(X, DestTy);
+                break;
+            case Instruction::Trunc:
+                if (isa<TruncInst>(Inner))
+                    return Builder.CreateTrunc(X, DestTy);
+                if (isExtension(Inner)) {
+                    if (SrcBits == DestBits)
+                        return X;
+                    if (SrcBits > DestBits)
+                        return Builder.CreateTrunc(X, DestTy);
+                    return Builder.CreateCast(Inner->getOpcode(), X, DestTy);
+                }
+                break;
+            default:
+                break;
+        }
+        return nullptr;
+    }
+
+    // The narrow constant for C, if extending it back with the same cast gives C again.
+    static Constant *getNarrowConstant(Value *C, CastInst *Ext) {
+        auto *RHSConstant = dyn_cast<ConstantInt>(C);
+        if (!RHSConstant)
+            return nullptr;
+        unsigned NarrowBits = Ext->getSrcTy()->getIntegerBitWidth();
+        APInt Narrow = RHSConstant->getValue().trunc(NarrowBits);
+        APInt Wide = isa<ZExtInst>(Ext) ? Narrow.zext(RHSConstant->getBitWidth()) : Narrow.sext(RHSConstant->getBitWidth());
+        if (Wide != RHSConstant->getValue())
+            return nullptr;
+        return ConstantInt::get(Ext->getSrcTy(), Narrow);
+    }
+
+    // icmp P (ext a), (ext b) -> icmp P a, b and icmp P (ext a), C -> icmp P a, C'
+    // zext keeps equality and unsigned order, sext keeps both orders.
+    // On i1 what is left is usually  icmp ne b, false  which is b itself.
+    static Value *foldCompare(ICmpInst *CmpInstr, IRBuilder<> &Builder) {
+        Value *LHS = CmpInstr->getOperand(0);
+        Value *RHS = CmpInstr->getOperand(1);
+        ICmpInst::Predicate Predicate = CmpInstr->getPredicate();
+
+        if (LHS->getType()->isIntegerTy(1)) {
+            if (auto *RHSConstant = dyn_cast<ConstantInt>(RHS)) {
+                if ((Predicate == ICmpInst::ICMP_NE && RHSConstant->isZero()) || (Predicate == ICmpInst::ICMP_EQ && RHSConstant->isOne()))
+                    return LHS;
+                if ((Predicate == ICmpInst::ICMP_EQ && RHSConstant->isZero()) || (Predicate == ICmpInst::ICMP_NE && RHSConstant->isOne()))
+                    return Builder.CreateNot(LHS);
+            }
+            return nullptr;
+        }
+
+        auto *Ext = dyn_cast<CastInst>(LHS);
+        if (!Ext || !isExtension(Ext))
+            return nullptr;
+        if (isa<ZExtInst>(Ext) && ICmpInst::isSigned(Predicate))
+            return nullptr;
+
+        Value *NarrowRHS = nullptr;
+        auto *ExtRHS = dyn_cast<CastInst>(RHS);
+        if (ExtRHS && ExtRHS->getOpcode() == Ext->getOpcode() && ExtRHS->getSrcTy() == Ext->getSrcTy())
+            NarrowRHS = ExtRHS->getOperand(0);
+        else
+            NarrowRHS = getNarrowConstant(RHS, Ext);
+        if (!NarrowRHS)
+            return nullptr;
+        return Builder.CreateICmp(Predicate, Ext->getOperand(0), NarrowRHS);
+    }
+
+    // and/or/xor (ext a), (ext b) -> ext (op a, b), and the same with a constant that survives the round trip.
+    // Only done when the extensions die, otherwise nothing gets narrower.
+    static Value *foldBitwise(BinaryOperator *BinaryOp, IRBuilder<> &Builder) {
+        if (!BinaryOp->isBitwiseLogicOp())
+            return nullptr;
+        auto *Ext = dyn_cast<CastInst>(BinaryOp->getOperand(0));
+        if (!Ext || !isExtension(Ext) || !Ext->hasOneUse())
+            return nullptr;
+
+        Value *RHS = BinaryOp->getOperand(1);
+        Value *NarrowRHS = nullptr;
+        auto *ExtRHS = dyn_cast<CastInst>(RHS);
+        if (ExtRHS && ExtRHS->getOpcode() == Ext->getOpcode() && ExtRHS->getSrcTy() == Ext->getSrcTy() && ExtRHS->hasOneUse())
+            NarrowRHS = ExtRHS->getOperand(0);
+        else if (isa<ConstantInt>(RHS) && BinaryOp->getOpcode() == Instruction::And && isa<ZExtInst>(Ext))
+            // The high bits of a zext are zero, so whatever the mask has there doesn't matter.
+            NarrowRHS = ConstantExpr::getTrunc(cast<ConstantInt>(RHS), Ext->getSrcTy());
+        else
+            NarrowRHS = getNarrowConstant(RHS, Ext);
+        if (!NarrowRHS)
+            return nullptr;
+
+        Value *Narrow = Builder.CreateBinOp(BinaryOp->getOpcode(), Ext->getOperand(0), NarrowRHS);
+        return Builder.CreateCast(Ext->getOpcode(), Narrow, BinaryOp->getType());
+    }
+};
+
+// select (icmp sgt a, b), a, b  /  c > 0 ? c : -c  /  select c, true, x   -------> llvm.smax / llvm.abs / or
+/*
+** The compare passes only look at the icmp, this one looks at what consumes it.
+** A select, or a phi at the end of an if/else diamond (which is how c ? a : b looks before mem2reg),
+** that picks one of the compared values is a min/max, and picking between a value and its negation
+** depending on the sign is abs. Selects on i1 are plain logic.
+ */
+struct SelectIdiomPass : public PassInfoMixin<SelectIdiomPass> {
+    static bool isRequired() { return true; }
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        bool changed = false;
+        InstructionsToRemove.clear();
+        CombineRemarks Remarks(F, FAM);
+        for (auto &BB : F) {
+            if (!isHotBlock(BB, FAM))
+                continue;
+            for (auto &I : BB) {
+                Value *NewInstr = nullptr;
+                if (auto *Select = dyn_cast<SelectInst>(&I)) {
+                    IRBuilder<> Builder(Select);
+                    NewInstr = foldSelect(Select->getCondition(), Select->getTrueValue(), Select->getFalseValue(), Builder);
+                } else if (auto *Phi = dyn_cast<PHINode>(&I)) {
+                    BasicBlock *IfTrue = nullptr;
+                    BasicBlock *IfFalse = nullptr;
+                    BranchInst *Branch = Phi->getNumIncomingValues() == 2 ? GetIfCondition(&BB, IfTrue, IfFalse) : nullptr;
+                    if (Branch) {
+                        IRBuilder<> Builder(&*BB.getFirstInsertionPt());
+                        NewInstr = foldMinMax(Branch->getCondition(), Phi->getIncomingValueForBlock(IfTrue), Phi->getIncomingValueForBlock(IfFalse), Builder);
                     }
                 }
 
-                for (Instruction* i :  InstructionsToRemove) {
-                    i->eraseFromParent();
+                if (NewInstr) {
+                    Remarks.replaced("SelectIdiom", &I, NewInstr);
+                    I.replaceAllUsesWith(NewInstr);
+                    InstructionsToRemove.push_back(&I);
+                    changed = true;
                 }
             }
+        }
+        eraseQueuedInstructions();
+        if(changed)
+            return PreservedAnalyses::none();
+        return PreservedAnalyses::all();
+    }
+
+    static Value *foldSelect(Value *Cond, Value *TrueValue, Value *FalseValue, IRBuilder<> &Builder) {
+        if (Cond->getType()->isIntegerTy(1) && TrueValue->getType()->isIntegerTy(1))
+            return foldBooleanSelect(Cond, TrueValue, FalseValue, Builder);
+        return foldMinMax(Cond, TrueValue, FalseValue, Builder);
+    }
 
-            errs() << "New IR: " << F << "\n";
-            // Verify that it is valid IR.
-            if (verifyFunction(F, &errs()))
-                errs() << "Function " << F.getName() << " is invalid!\n";
-            else
-                errs() << "Function " << F.getName() << " is valid!\n";
+    // select c, true, x -> c | x      select c, x, false -> c & x
+    // The select doesn't look at x when c decides, the or/and does, so x is frozen unless it can't be poison.
+    static Value *foldBooleanSelect(Value *Cond, Value *TrueValue, Value *FalseValue, IRBuilder<> &Builder) {
+        auto *TrueConstant = dyn_cast<ConstantInt>(TrueValue);
+        auto *FalseConstant = dyn_cast<ConstantInt>(FalseValue);
+        if (TrueConstant && FalseConstant) {
+            if (TrueConstant->isOne() && FalseConstant->isZero())
+                return Cond;
+            if (TrueConstant->isZero() && FalseConstant->isOne())
+                return Builder.CreateNot(Cond);
+            return nullptr;
+        }
 
+        auto Frozen = [&Builder](Value *V) {
+            return isGuaranteedNotToBePoison(V) ? V : Builder.CreateFreeze(V);
+        };
+        if (TrueConstant)
+            return TrueConstant->isOne() ? Builder.CreateOr(Cond, Frozen(FalseValue)) : Builder.CreateAnd(Builder.CreateNot(Cond), Frozen(FalseValue));
+        if (FalseConstant)
+            return FalseConstant->isZero() ? Builder.CreateAnd(Cond, Frozen(TrueValue)) : Builder.CreateOr(Builder.CreateNot(Cond), Frozen(TrueValue));
+        return nullptr;
+    }
 
+    static Value *foldMinMax(Value *Cond, Value *TrueValue, Value *FalseValue, IRBuilder<> &Builder) {
+        ICmpInst::Predicate Predicate;
+        Value *A = nullptr;
+        Value *B = nullptr;
+        if (!match(Cond, m_ICmp(Predicate, m_Value(A), m_Value(B))) || !A->getType()->isIntOrIntVectorTy())
+            return nullptr;
+        if (A->getType() != TrueValue->getType())
+            return nullptr;
+
+        if (Value *Abs = foldAbs(Predicate, A, B, TrueValue, FalseValue, Builder))
+            return Abs;
+
+        // With the arms swapped, select (a < b), b, a is select (a >= b), a, b.
+        if (isSameLoadedValue(TrueValue, B) && isSameLoadedValue(FalseValue, A))
+            Predicate = ICmpInst::getInversePredicate(Predicate);
+        else if (!isSameLoadedValue(TrueValue, A) || !isSameLoadedValue(FalseValue, B))
+            return nullptr;
+
+        switch (Predicate) {
+            case ICmpInst::ICMP_SGT:
+            case ICmpInst::ICMP_SGE:
+                return Builder.CreateBinaryIntrinsic(Intrinsic::smax, A, B);
+            case ICmpInst::ICMP_SLT:
+            case ICmpInst::ICMP_SLE:
+                return Builder.CreateBinaryIntrinsic(Intrinsic::smin, A, B);
+            case ICmpInst::ICMP_UGT:
+            case ICmpInst::ICMP_UGE:
+                return Builder.CreateBinaryIntrinsic(Intrinsic::umax, A, B);
+            case ICmpInst::ICMP_ULT:
+            case ICmpInst::ICMP_ULE:
+                return Builder.CreateBinaryIntrinsic(Intrinsic::umin, A, B);
+            default:
+                return nullptr;
         }
+    }
+
+    // a < 0 ? -a : a  and  a > 0 ? a : -a (also with <=, >= and > -1)
+    static Value *foldAbs(ICmpInst::Predicate Predicate, Value *A, Value *B, Value *TrueValue, Value *FalseValue, IRBuilder<> &Builder) {
+        bool NegativeFirst = false;
+        if (match(B, m_Zero()) && (Predicate == ICmpInst::ICMP_SLT || Predicate == ICmpInst::ICMP_SLE))
+            NegativeFirst = true;
+        else if (match(B, m_Zero()) && (Predicate == ICmpInst::ICMP_SGT || Predicate == ICmpInst::ICMP_SGE))
+            NegativeFirst = false;
+        else if (match(B, m_AllOnes()) && Predicate == ICmpInst::ICMP_SGT)
+            NegativeFirst = false;
+        else
+            return nullptr;
+
+        Value *Negated = NegativeFirst ? TrueValue : FalseValue;
+        Value *Plain = NegativeFirst ? FalseValue : TrueValue;
+        Value *X = nullptr;
+        if (!match(Negated, m_Neg(m_Value(X))) || !isSameLoadedValue(X, A) || !isSameLoadedValue(Plain, A))
+            return nullptr;
+
+        // -INT_MIN is only poison if the negation said so.
+        bool IntMinIsPoison = cast<BinaryOperator>(Negated)->hasNoSignedWrap();
+        return Builder.CreateIntrinsic(Intrinsic::abs, {A->getType()}, {A, Builder.getInt1(IntMinIsPoison)});
+    }
+};
+
+// Floating point counterparts of the integer rules, each one only where the FastMathFlags allow it:
+/*
+**    fadd 2.0, x          -------> fadd x, 2.0                   (constants to RHS, always)
+**    fadd x, x            -------> fmul x, 2.0                   (exact, always)
+**    fdiv x, 4.0          -------> fmul x, 0.25                  (when 1/C is exact, or with arcp)
+**    fmul (fmul x, C1), C2  -----> fmul x, C1*C2                 (with reassoc, fadd also needs nsz)
+**
+** Scaling by a power of two is left as an fmul, that already is the cheapest scaling on our targets
+** and LLVM 14 has no ldexp intrinsic to rewrite it into.
+ */
+struct FloatCombiningPass : public PassInfoMixin<FloatCombiningPass> {
+    static bool isRequired() { return true; }
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        bool changed = false;
         InstructionsToRemove.clear();
-        return PreservedAnalyses::none();
+        const DataLayout &DL = F.getParent()->getDataLayout();
+        CombineRemarks Remarks(F, FAM);
+        for (auto &BB : F) {
+            bool Hot = isHotBlock(BB, FAM);
+            for (auto &I : BB) {
+                auto *BinaryOp = dyn_cast<BinaryOperator>(&I);
+                if (!BinaryOp || !BinaryOp->getType()->isFPOrFPVectorTy())
+                    continue;
+                IRBuilder<> Builder(BinaryOp);
+                Value *op1 = BinaryOp->getOperand(0);
+                Value *op2 = BinaryOp->getOperand(1);
+                Value *NewInstr = nullptr;
+                switch (BinaryOp->getOpcode()) {
+                    case Instruction::FAdd:
+                        if (isa<Constant>(op1) && !isa<Constant>(op2))
+                            NewInstr = Builder.CreateFAddFMF(op2, op1, BinaryOp);
+                        else if (isSameLoadedValue(op1, op2))
+                            NewInstr = Builder.CreateFMulFMF(op1, ConstantFP::get(BinaryOp->getType(), 2.0), BinaryOp);
+                        else if (Hot)
+                            NewInstr = reassociateConstants(BinaryOp, Builder, DL);
+                        break;
+                    case Instruction::FMul:
+                        if (isa<Constant>(op1) && !isa<Constant>(op2))
+                            NewInstr = Builder.CreateFMulFMF(op2, op1, BinaryOp);
+                        else if (Hot)
+                            NewInstr = reassociateConstants(BinaryOp, Builder, DL);
+                        break;
+                    case Instruction::FDiv:
+                        if (Constant *Reciprocal = getReciprocal(BinaryOp))
+                            NewInstr = Builder.CreateFMulFMF(op1, Reciprocal, BinaryOp);
+                        break;
+                    default:
+                        break;
+                }
+
+                if (NewInstr) {
+                    Remarks.replaced("FloatCombining", BinaryOp, NewInstr);
+                    BinaryOp->replaceAllUsesWith(NewInstr);
+                    InstructionsToRemove.push_back(BinaryOp);
+                    changed = true;
+                }
+            }
+        }
+        eraseQueuedInstructions();
+        if(changed)
+            return PreservedAnalyses::none();
+        return PreservedAnalyses::all();
+    }
+
+    static bool canReassociate(BinaryOperator *BinaryOp) {
+        if (!BinaryOp->hasAllowReassoc())
+            return false;
+        return BinaryOp->getOpcode() != Instruction::FAdd || BinaryOp->hasNoSignedZeros();
+    }
+
+    // (x op C1) op C2 -> x op (C1 op C2), with the flags both instructions agree on.
+    static Value *reassociateConstants(BinaryOperator *BinaryOp, IRBuilder<> &Builder, const DataLayout &DL) {
+        auto *Inner = dyn_cast<BinaryOperator>(BinaryOp->getOperand(0));
+        auto *C2 = dyn_cast<Constant>(BinaryOp->getOperand(1));
+        if (!Inner || !C2 || Inner->getOpcode() != BinaryOp->getOpcode() || !Inner->hasOneUse())
+            return nullptr;
+        auto *C1 = dyn_cast<Constant>(Inner->getOperand(1));
+        if (!C1 || !canReassociate(BinaryOp) || !canReassociate(Inner))
+            return nullptr;
+        Constant *Folded = ConstantFoldBinaryOpOperands(BinaryOp->getOpcode(), C1, C2, DL);
+        if (!Folded)
+            return nullptr;
+
+        FastMathFlags FMF = BinaryOp->getFastMathFlags();
+        FMF &= Inner->getFastMathFlags();
+        Builder.setFastMathFlags(FMF);
+        return Builder.CreateBinOp(BinaryOp->getOpcode(), Inner->getOperand(0), Folded);
+    }
+
+    // 1/C for fdiv x, C: always when it is exact (C is a power of two), otherwise only with arcp.
+    static Constant *getReciprocal(BinaryOperator *BinaryOp) {
+        auto *Divisor = dyn_cast<ConstantFP>(BinaryOp->getOperand(1));
+        if (!Divisor)
+            return nullptr;
+        APFloat Reciprocal(Divisor->getValueAPF().getSemantics());
+        if (Divisor->getValueAPF().getExactInverse(&Reciprocal))
+            return ConstantFP::get(BinaryOp->getType(), Reciprocal);
+        if (!BinaryOp->hasAllowReciprocal() || Divisor->isZero() || !Divisor->getValueAPF().isFinite())
+            return nullptr;
+        Reciprocal = APFloat(Divisor->getValueAPF().getSemantics(), 1);
+        Reciprocal.divide(Divisor->getValueAPF(), APFloat::rmNearestTiesToEven);
+        return ConstantFP::get(BinaryOp->getType(), Reciprocal);
+    }
+};
+
+// Open-coded bit manipulation   -------> llvm.fshl / llvm.fshr / llvm.ctpop / llvm.ctlz / llvm.cttz
+/*
+** The shift passes above only create shifts, this one recognises what shifts are used for:
+**    (x << n) | (x >> (w - n))                                    -------> fshl(x, x, n)
+**    if (x) do { x &= x - 1; c++; } while (x);                     -------> c += ctpop(x)
+**    if (x) do { x >>= 1; c++; } while (x);                        -------> c += w - ctlz(x)
+**    if (!(x & 1)) do { x >>= 1; c++; } while (!(x & 1));          -------> c += cttz(x)
+**
+** The loops are found through LoopInfo and have to be a single block with one exit, counting by one.
+** The guard in front of the loop is what makes the do-while count match the intrinsic, so it is required.
+** When nothing but the count left the loop, the loop is deleted as well.
+ */
+struct BitIdiomRecognitionPass : public PassInfoMixin<BitIdiomRecognitionPass> {
+    static bool isRequired() { return true; }
+    enum class CountingLoop { None, Popcount, BitLength, TrailingZeros };
+
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        bool changed = false;
+        InstructionsToRemove.clear();
+        CombineRemarks Remarks(F, FAM);
+        for (auto &BB : F) {
+            for (auto &I : BB) {
+                auto *BinaryOp = dyn_cast<BinaryOperator>(&I);
+                if (!BinaryOp || BinaryOp->getOpcode() != Instruction::Or)
+                    continue;
+                IRBuilder<> Builder(BinaryOp);
+                Value *Rotate = matchRotate(BinaryOp->getOperand(0), BinaryOp->getOperand(1), Builder);
+                if (!Rotate)
+                    Rotate = matchRotate(BinaryOp->getOperand(1), BinaryOp->getOperand(0), Builder);
+                if (Rotate) {
+                    Remarks.replaced("BitIdiom", BinaryOp, Rotate);
+                    BinaryOp->replaceAllUsesWith(Rotate);
+                    InstructionsToRemove.push_back(BinaryOp);
+                    changed = true;
+                }
+            }
+        }
+        eraseQueuedInstructions();
+
+        auto &LI = FAM.getResult<LoopAnalysis>(F);
+        auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+        auto &AC = FAM.getResult<AssumptionAnalysis>(F);
+        // Only innermost loops can match, so deleting one never touches a loop that is still to be visited.
+        for (Loop *L : LI.getLoopsInPreorder()) {
+            if (L->isInnermost())
+                changed |= replaceCountingLoop(L, LI, DT, AC, Remarks);
+        }
+        if(changed)
+            return PreservedAnalyses::none();
+        return PreservedAnalyses::all();
+    }
+
+    // Shl is (x << n), Lshr is (x >> m) with n + m == w, either as constants or as m = w - n (or n = w - m).
+    static Value *matchRotate(Value *Shl, Value *Lshr, IRBuilder<> &Builder) {
+        Value *X = nullptr, *X2 = nullptr, *ShlAmount = nullptr, *LshrAmount = nullptr;
+        if (!match(Shl, m_OneUse(m_Shl(m_Value(X), m_Value(ShlAmount)))) || !match(Lshr, m_OneUse(m_LShr(m_Value(X2), m_Value(LshrAmount)))))
+            return nullptr;
+        if (!isSameLoadedValue(X, X2))
+            return nullptr;
+        unsigned Width = X->getType()->getScalarSizeInBits();
+
+        const APInt *ShlConstant, *LshrConstant;
+        if (match(ShlAmount, m_APInt(ShlConstant)) && match(LshrAmount, m_APInt(LshrConstant))) {
+            if (ShlConstant->ult(Width) && LshrConstant->ult(Width) && *ShlConstant + *LshrConstant == Width)
+                return Builder.CreateIntrinsic(Intrinsic::fshl, {X->getType()}, {X, X, ShlAmount});
+            return nullptr;
+        }
+        Value *Amount = nullptr;
+        if (match(LshrAmount, m_Sub(m_SpecificInt(Width), m_Value(Amount))) && isSameLoadedValue(Amount, ShlAmount))
+            return Builder.CreateIntrinsic(Intrinsic::fshl, {X->getType()}, {X, X, ShlAmount});
+        if (match(ShlAmount, m_Sub(m_SpecificInt(Width), m_Value(Amount))) && isSameLoadedValue(Amount, LshrAmount))
+            return Builder.CreateIntrinsic(Intrinsic::fshr, {X->getType()}, {X, X, LshrAmount});
+        return nullptr;
+    }
+
+    // Which counting loop the header is, given x' (the next x) and when the loop exits.
+    static CountingLoop classifyLoop(PHINode *XPhi, Value *XNext, ICmpInst *ExitCmp, bool ExitWhenTrue) {
+        ICmpInst::Predicate ExitPredicate = ExitWhenTrue ? ExitCmp->getPredicate() : ExitCmp->getInversePredicate();
+        if (!match(ExitCmp->getOperand(1), m_Zero()))
+            return CountingLoop::None;
+        Value *Tested = ExitCmp->getOperand(0);
+
+        if (ExitPredicate == ICmpInst::ICMP_EQ && Tested == XNext) {
+            if (match(XNext, m_c_And(m_Specific(XPhi), m_Add(m_Specific(XPhi), m_AllOnes()))))
+                return CountingLoop::Popcount;
+            if (match(XNext, m_LShr(m_Specific(XPhi), m_One())))
+                return CountingLoop::BitLength;
+        }
+        if (ExitPredicate == ICmpInst::ICMP_NE && match(Tested, m_And(m_Specific(XNext), m_One())) && match(XNext, m_LShr(m_Specific(XPhi), m_One())))
+            return CountingLoop::TrailingZeros;
+        return CountingLoop::None;
+    }
+
+    // The branch into the preheader has to establish what the do-while needs: x != 0, and for cttz (x & 1) == 0 too.
+    // The cttz guard lets x == 0 in, and that loop never ends. Unless the loop has to make progress,
+    // x has to be known non-zero as well, or the rewrite would turn the hang into a result.
+    static bool isGuarded(Loop *L, Value *X0, CountingLoop Kind, DominatorTree &DT, AssumptionCache &AC) {
+        if (Kind != CountingLoop::TrailingZeros && isKnownNonZero(X0, L->getHeader()->getModule()->getDataLayout()))
+            return true;
+        BasicBlock *Preheader = L->getLoopPreheader();
+        BasicBlock *Guard = Preheader->getSinglePredecessor();
+        auto *Branch = Guard ? dyn_cast<BranchInst>(Guard->getTerminator()) : nullptr;
+        if (!Branch || !Branch->isConditional())
+            return false;
+        auto *GuardCmp = dyn_cast<ICmpInst>(Branch->getCondition());
+        if (!GuardCmp)
+            return false;
+        bool LoopWhenTrue = Branch->getSuccessor(0) == Preheader;
+        ICmpInst::Predicate LoopPredicate = LoopWhenTrue ? GuardCmp->getPredicate() : GuardCmp->getInversePredicate();
+        if (!match(GuardCmp->getOperand(1), m_Zero()))
+            return false;
+        if (Kind == CountingLoop::TrailingZeros)
+            return LoopPredicate == ICmpInst::ICMP_EQ && match(GuardCmp->getOperand(0), m_And(m_Specific(X0), m_One())) &&
+                   (isMustProgress(L) ||
+                    isKnownNonZero(X0, Preheader->getModule()->getDataLayout(), 0, &AC, Preheader->getTerminator(), &DT));
+        return LoopPredicate == ICmpInst::ICMP_NE && GuardCmp->getOperand(0) == X0;
+    }
+
+    bool replaceCountingLoop(Loop *L, LoopInfo &LI, DominatorTree &DT, AssumptionCache &AC, CombineRemarks &Remarks) {
+        BasicBlock *Header = L->getHeader();
+        BasicBlock *Preheader = L->getLoopPreheader();
+        BasicBlock *Exit = L->getExitBlock();
+        if (L->getNumBlocks() != 1 || !Preheader || !Exit)
+            return false;
+        auto *Branch = dyn_cast<BranchInst>(Header->getTerminator());
+        auto *ExitCmp = Branch && Branch->isConditional() ? dyn_cast<ICmpInst>(Branch->getCondition()) : nullptr;
+        if (!ExitCmp)
+            return false;
+        bool ExitWhenTrue = Branch->getSuccessor(0) == Exit;
+
+        // One phi carries x, the other one the counter.
+        PHINode *XPhi = nullptr;
+        PHINode *CountPhi = nullptr;
+        CountingLoop Kind = CountingLoop::None;
+        for (PHINode &Phi : Header->phis()) {
+            Value *Next = Phi.getIncomingValueForBlock(Header);
+            CountingLoop PhiKind = classifyLoop(&Phi, Next, ExitCmp, ExitWhenTrue);
+            if (match(Next, m_Add(m_Specific(&Phi), m_One()))) {
+                CountPhi = &Phi;
+            } else if (PhiKind != CountingLoop::None) {
+                XPhi = &Phi;
+                Kind = PhiKind;
+            }
+        }
+        if (!XPhi || !CountPhi)
+            return false;
+        Value *X0 = XPhi->getIncomingValueForBlock(Preheader);
+        Value *Count0 = CountPhi->getIncomingValueForBlock(Preheader);
+        auto *CountNext = cast<Instruction>(CountPhi->getIncomingValueForBlock(Header));
+        for (User *U : CountPhi->users()) {
+            if (!L->contains(cast<Instruction>(U)))
+                return false;
+        }
+        if (!isGuarded(L, X0, Kind, DT, AC))
+            return false;
+
+        IRBuilder<> Builder(Preheader->getTerminator());
+        // Everything after this one is what the rewrite creates.
+        Instruction *PreheaderEnd = Preheader->getTerminator()->getPrevNode();
+        Type *XTy = X0->getType();
+        Value *Bits = nullptr;
+        const char *IntrinsicName = nullptr;
+        switch (Kind) {
+            case CountingLoop::Popcount:
+                Bits = Builder.CreateUnaryIntrinsic(Intrinsic::ctpop, X0);
+                IntrinsicName = "llvm.ctpop";
+                break;
+            case CountingLoop::BitLength:
+                Bits = Builder.CreateSub(ConstantInt::get(XTy, XTy->getIntegerBitWidth()),
+                                         Builder.CreateBinaryIntrinsic(Intrinsic::ctlz, X0, Builder.getTrue()));
+                IntrinsicName = "llvm.ctlz";
+                break;
+            case CountingLoop::TrailingZeros:
+                // isGuarded() rules out x == 0, the intrinsic is just given a defined result for it.
+                Bits = Builder.CreateBinaryIntrinsic(Intrinsic::cttz, X0, Builder.getFalse());
+                IntrinsicName = "llvm.cttz";
+                break;
+            default:
+                return false;
+        }
+        Value *NewCount = Builder.CreateZExtOrTrunc(Bits, Count0->getType());
+        if (!match(Count0, m_Zero()))
+            NewCount = Builder.CreateAdd(Count0, NewCount);
+
+        // The count is computed once, priced against what one iteration of the loop used to cost.
+        SmallVector<Instruction *, 8> Iteration;
+        for (Instruction &I : *Header)
+            Iteration.push_back(&I);
+        SmallVector<Value *, 4> Added;
+        Instruction *Created = PreheaderEnd ? PreheaderEnd->getNextNode() : &Preheader->front();
+        for (; Created != Preheader->getTerminator(); Created = Created->getNextNode())
+            Added.push_back(Created);
+        Remarks.rewritten("BitIdiom", Header->getTerminator(), Added, Iteration, std::string("counting loop replaced by ") + IntrinsicName);
+        CountNext->replaceUsesWithIf(NewCount, [L](Use &U) {
+            return !L->contains(cast<Instruction>(U.getUser()));
+        });
+
+        // With the count computed up front, the loop is dead if nothing else leaves it.
+        for (Instruction &I : *Header) {
+            if (I.mayHaveSideEffects())
+                return true;
+            for (User *U : I.users()) {
+                if (!L->contains(cast<Instruction>(U)))
+                    return true;
+            }
+        }
+        if (L->getUniqueExitBlock() && L->hasDedicatedExits() && L->isLCSSAForm(DT))
+            deleteDeadLoop(L, &DT, nullptr, &LI);
+        return true;
+    }
+};
+
+// What the other rules leave behind in bitwise code, decided by the known bits of the operands:
+/*
+**    and x, m  /  or x, m  where m changes no bit that can still differ          -------> x
+**    xor (xor a, b), (xor a, -1)  and other xor trees with repeated leaves        -------> xor b, -1
+**    lshr (shl x, c), c  where the top c bits of x are known zero                 -------> x
+**    shl x, s  /  lshr x, s  that move out every bit that can be one              -------> 0
+**    ashr x, s  where x is known non-negative                                    -------> lshr x, s
+**    add/sub/mul/and/or/xor (zext a), (zext b)  with the high bits known zero     -------> zext of the narrow operation
+**    any of these with every bit known                                           -------> the constant
+**
+** ReplaceCompareInstructionsPass writes a == b as not(xor(a, b)) and CastFoldingPass adds its own not for a compare
+** against false, so on boolean code the xor trees are where most of the work is.
+** Like CastFoldingPass, the function is swept until nothing changes.
+ */
+struct KnownBitsSimplificationPass : public PassInfoMixin<KnownBitsSimplificationPass> {
+    static bool isRequired() { return true; }
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        bool changed = false;
+        InstructionsToRemove.clear();
+        const DataLayout &DL = F.getParent()->getDataLayout();
+        SimplifyQuery Query(DL, &FAM.getResult<TargetLibraryAnalysis>(F), &FAM.getResult<DominatorTreeAnalysis>(F),
+                            &FAM.getResult<AssumptionAnalysis>(F));
+        CombineRemarks Remarks(F, FAM);
+        bool sweepChanged = true;
+        while (sweepChanged) {
+            sweepChanged = false;
+            for (auto &BB : F) {
+                for (auto &I : BB) {
+                    auto *BinaryOp = dyn_cast<BinaryOperator>(&I);
+                    if (!BinaryOp || !BinaryOp->getType()->isIntegerTy() || BinaryOp->use_empty())
+                        continue;
+                    Value *NewInstr = simplify(BinaryOp, Query.getWithInstruction(BinaryOp));
+
+                    if (NewInstr) {
+                        Remarks.replaced("KnownBits", &I, NewInstr);
+                        I.replaceAllUsesWith(NewInstr);
+                        InstructionsToRemove.push_back(&I);
+                        sweepChanged = true;
+                    }
+                }
+            }
+            eraseQueuedInstructions();
+            changed |= sweepChanged;
+        }
+        if(changed)
+            return PreservedAnalyses::none();
+        return PreservedAnalyses::all();
+    }
+
+    static Value *simplify(BinaryOperator *BinaryOp, const SimplifyQuery &Query) {
+        auto Opcode = BinaryOp->getOpcode();
+        if (!BinaryOp->isBitwiseLogicOp() && !BinaryOp->isShift())
+            return narrow(BinaryOp, Query);
+
+        // Whatever instsimplify already knows from the known bits, e.g.  and (zext i1 a), 1  or  xor a, a.
+        if (Value *Simplified = SimplifyInstruction(BinaryOp, Query))
+            return Simplified;
+        KnownBits Known = computeKnownBits(BinaryOp, Query.DL, 0, Query.AC, Query.CxtI, Query.DT);
+        if (Known.isConstant())
+            return ConstantInt::get(BinaryOp->getType(), Known.getConstant());
+
+        Value *LHS = BinaryOp->getOperand(0);
+        Value *RHS = BinaryOp->getOperand(1);
+        KnownBits LHSKnown = computeKnownBits(LHS, Query.DL, 0, Query.AC, Query.CxtI, Query.DT);
+        KnownBits RHSKnown = computeKnownBits(RHS, Query.DL, 0, Query.AC, Query.CxtI, Query.DT);
+        switch (Opcode) {
+            case Instruction::And:
+                // The mask is one wherever the other side may be one.
+                if ((~LHSKnown.Zero & ~RHSKnown.One).isZero())
+                    return LHS;
+                if ((~RHSKnown.Zero & ~LHSKnown.One).isZero())
+                    return RHS;
+                break;
+            case Instruction::Or:
+                // The other side is already one wherever this one may be one.
+                if ((~RHSKnown.Zero & ~LHSKnown.One).isZero())
+                    return LHS;
+                if ((~LHSKnown.Zero & ~RHSKnown.One).isZero())
+                    return RHS;
+                break;
+            case Instruction::Xor:
+                if (Value *Folded = foldXorTree(BinaryOp))
+                    return Folded;
+                break;
+            default:
+                return foldShift(BinaryOp, LHSKnown, RHSKnown, Query);
+        }
+        return narrow(BinaryOp, Query);
+    }
+
+    // Flattens the xor tree rooted at V into its leaves and constant. Inner xors are only looked through
+    // while nothing else uses them, so the rebuilt tree replaces them all.
+    static void collectXorLeaves(Value *V, bool IsRoot, SmallVectorImpl<Value *> &Leaves, APInt &Constant, unsigned &Constants) {
+        auto *Xor = dyn_cast<BinaryOperator>(V);
+        if (Xor && Xor->getOpcode() == Instruction::Xor && (IsRoot || Xor->hasOneUse())) {
+            collectXorLeaves(Xor->getOperand(0), false, Leaves, Constant, Constants);
+            collectXorLeaves(Xor->getOperand(1), false, Leaves, Constant, Constants);
+        } else if (auto *C = dyn_cast<ConstantInt>(V)) {
+            Constant ^= C->getValue();
+            Constants++;
+        } else
+            Leaves.push_back(V);
+    }
+
+    // A leaf that appears twice cancels out, and all constants become one. The tree is rebuilt from its root,
+    // which is the xor not used by another single-use xor.
+    static Value *foldXorTree(BinaryOperator *Root) {
+        if (Root->hasOneUse()) {
+            auto *User = dyn_cast<BinaryOperator>(Root->user_back());
+            if (User && User->getOpcode() == Instruction::Xor)
+                return nullptr;
+        }
+        SmallVector<Value *, 8> Leaves;
+        APInt Constant = APInt::getZero(Root->getType()->getIntegerBitWidth());
+        unsigned Constants = 0;
+        collectXorLeaves(Root, true, Leaves, Constant, Constants);
+
+        SmallDenseMap<Value *, unsigned, 8> Occurrences;
+        for (Value *Leaf : Leaves)
+            Occurrences[Leaf]++;
+        SmallVector<Value *, 8> Remaining;
+        for (Value *Leaf : Leaves) {
+            unsigned &Count = Occurrences[Leaf];
+            if (Count % 2)
+                Remaining.push_back(Leaf);
+            Count = 0;
+        }
+        if (Remaining.size() == Leaves.size() && Constants <= 1)
+            return nullptr;
+
+        IRBuilder<> Builder(Root);
+        Value *Result = nullptr;
+        for (Value *Leaf : Remaining)
+            Result = Result ? Builder.CreateXor(Result, Leaf) : Leaf;
+        if (!Result)
+            return Builder.getInt(Constant);
+        if (!Constant.isZero())
+            Result = Builder.CreateXor(Result, Builder.getInt(Constant));
+        return Result;
+    }
+
+    static Value *foldShift(BinaryOperator *Shift, const KnownBits &ValueKnown, const KnownBits &AmountKnown,
+                            const SimplifyQuery &Query) {
+        Value *X = Shift->getOperand(0);
+        Value *Amount = Shift->getOperand(1);
+        unsigned BitWidth = ValueKnown.getBitWidth();
+        uint64_t MinAmount = AmountKnown.getMinValue().getLimitedValue(BitWidth);
+        IRBuilder<> Builder(Shift);
+
+        // Every bit that can be one ends up past the end.
+        if (Shift->getOpcode() == Instruction::Shl && ValueKnown.countMaxActiveBits() > 0 &&
+            ValueKnown.countMinTrailingZeros() + MinAmount >= BitWidth)
+            return Constant::getNullValue(Shift->getType());
+        if (Shift->getOpcode() == Instruction::LShr && ValueKnown.countMaxActiveBits() <= MinAmount)
+            return Constant::getNullValue(Shift->getType());
+
+        // Shifting back what was shifted out, when the bits that fell off are known to be what comes back in.
+        auto *Inner = dyn_cast<BinaryOperator>(X);
+        const APInt *C = nullptr;
+        if (Inner && Inner->isShift() && match(Amount, m_APInt(C)) && match(Inner->getOperand(1), m_Specific(Amount)) &&
+            C->ult(BitWidth)) {
+            Value *Y = Inner->getOperand(0);
+            unsigned ShiftBy = C->getZExtValue();
+            KnownBits YKnown = computeKnownBits(Y, Query.DL, 0, Query.AC, Query.CxtI, Query.DT);
+            if (Inner->getOpcode() == Instruction::Shl && Shift->getOpcode() == Instruction::LShr &&
+                YKnown.countMinLeadingZeros() >= ShiftBy)
+                return Y;
+            if (Inner->getOpcode() == Instruction::Shl && Shift->getOpcode() == Instruction::AShr &&
+                ComputeNumSignBits(Y, Query.DL, 0, Query.AC, Query.CxtI, Query.DT) > ShiftBy)
+                return Y;
+            if (Inner->getOpcode() == Instruction::LShr && Shift->getOpcode() == Instruction::Shl &&
+                YKnown.countMinTrailingZeros() >= ShiftBy)
+                return Y;
+        }
+
+        // Without a sign bit an arithmetic shift is a logical one, which the other rules understand.
+        if (Shift->getOpcode() == Instruction::AShr && ValueKnown.isNonNegative())
+            return Builder.CreateLShr(X, Amount, "", Shift->isExact());
+        return nullptr;
+    }
+
+    // The narrow type the operation fits in: a legal integer at least as wide as the zext sources,
+    // below which every bit of the result is known zero.
+    static Type *getNarrowType(BinaryOperator *BinaryOp, const SimplifyQuery &Query) {
+        unsigned BitWidth = BinaryOp->getType()->getIntegerBitWidth();
+        unsigned Needed = BitWidth - computeKnownBits(BinaryOp, Query.DL, 0, Query.AC, Query.CxtI, Query.DT).countMinLeadingZeros();
+        for (Value *Operand : BinaryOp->operands()) {
+            if (auto *Ext = dyn_cast<ZExtInst>(Operand))
+                Needed = std::max(Needed, Ext->getSrcTy()->getIntegerBitWidth());
+        }
+        for (unsigned Width = 8; Width < BitWidth; Width *= 2) {
+            if (Width >= Needed && Query.DL.isLegalInteger(Width))
+                return IntegerType::get(BinaryOp->getContext(), Width);
+        }
+        return nullptr;
+    }
+
+    // add/sub/mul/and/or/xor keep the low bits of the result from the low bits of the operands, so with two dying
+    // zexts the operation can happen in the narrow type and be extended once, as long as nothing is lost above it.
+    static Value *narrow(BinaryOperator *BinaryOp, const SimplifyQuery &Query) {
+        switch (BinaryOp->getOpcode()) {
+            case Instruction::Add:
+            case Instruction::Sub:
+            case Instruction::Mul:
+            case Instruction::And:
+            case Instruction::Or:
+            case Instruction::Xor:
+                break;
+            default:
+                return nullptr;
+        }
+        for (Value *Operand : BinaryOp->operands()) {
+            if (!isa<ZExtInst>(Operand) || !Operand->hasOneUse())
+                return nullptr;
+        }
+        // One of the zexts has to come from the narrow type already, otherwise the rewrite is no shorter.
+        Type *NarrowTy = getNarrowType(BinaryOp, Query);
+        if (!NarrowTy || (cast<ZExtInst>(BinaryOp->getOperand(0))->getSrcTy() != NarrowTy &&
+                          cast<ZExtInst>(BinaryOp->getOperand(1))->getSrcTy() != NarrowTy))
+            return nullptr;
+
+        IRBuilder<> Builder(BinaryOp);
+        Value *LHS = Builder.CreateZExtOrTrunc(cast<ZExtInst>(BinaryOp->getOperand(0))->getOperand(0), NarrowTy);
+        Value *RHS = Builder.CreateZExtOrTrunc(cast<ZExtInst>(BinaryOp->getOperand(1))->getOperand(0), NarrowTy);
+        Value *Narrow = Builder.CreateBinOp(BinaryOp->getOpcode(), LHS, RHS);
+        return Builder.CreateZExt(Narrow, BinaryOp->getType());
+    }
+};
+
+// Address arithmetic, walked the same way RHSMovePass walks binary operators:
+/*
+**    gep (gep p, 0, 1), 0, 2        -------> gep i8, p, <byte offset>            (whole chain of constant indices)
+**    gep (gep p, C), V              -------> gep (gep p, V), C                   (constant offset outermost, folds into the addressing mode)
+**    inttoptr (add (ptrtoint p), V) -------> gep i8, p, V
+**    inttoptr (ptrtoint p)          -------> p
+ */
+struct AddressFoldingPass : public PassInfoMixin<AddressFoldingPass> {
+    static bool isRequired() { return true; }
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        bool changed = false;
+        InstructionsToRemove.clear();
+        const DataLayout &DL = F.getParent()->getDataLayout();
+        CombineRemarks Remarks(F, FAM);
+        for (auto &BB : F) {
+            for (auto &I : BB) {
+                IRBuilder<> Builder(&I);
+                Value *NewInstr = nullptr;
+                switch (I.getOpcode()) {
+                    case Instruction::GetElementPtr:
+                        NewInstr = foldConstantChain(cast<GetElementPtrInst>(&I), Builder, DL);
+                        if (!NewInstr)
+                            NewInstr = moveConstantOutward(cast<GetElementPtrInst>(&I), Builder);
+                        break;
+                    case Instruction::IntToPtr:
+                        NewInstr = foldIntToPtr(cast<IntToPtrInst>(&I), Builder, DL);
+                        break;
+                    default:
+                        continue;
+                }
+
+                if (NewInstr) {
+                    Remarks.replaced("AddressFolding", &I, NewInstr);
+                    I.replaceAllUsesWith(NewInstr);
+                    InstructionsToRemove.push_back(&I);
+                    changed = true;
+                }
+            }
+        }
+        eraseQueuedInstructions();
+        if(changed)
+            return PreservedAnalyses::none();
+        return PreservedAnalyses::all();
+    }
+
+    // p + Offset as an i8 GEP, cast back to the type the users expect.
+    static Value *createByteOffset(Value *Base, Value *Offset, Type *ResultTy, bool InBounds, IRBuilder<> &Builder) {
+        unsigned AddrSpace = Base->getType()->getPointerAddressSpace();
+        Value *BytePtr = Builder.CreateBitCast(Base, Builder.getInt8PtrTy(AddrSpace));
+        Value *Gep = InBounds ? Builder.CreateInBoundsGEP(Builder.getInt8Ty(), BytePtr, Offset)
+                              : Builder.CreateGEP(Builder.getInt8Ty(), BytePtr, Offset);
+        return Builder.CreatePointerCast(Gep, ResultTy);
+    }
+
+    static Value *foldConstantChain(GetElementPtrInst *Gep, IRBuilder<> &Builder, const DataLayout &DL) {
+        if (!Gep->hasAllConstantIndices() || Gep->getType()->isVectorTy())
+            return nullptr;
+        auto *Inner = dyn_cast<GetElementPtrInst>(Gep->getPointerOperand()->stripPointerCasts());
+        if (!Inner || !Inner->hasAllConstantIndices())
+            return nullptr;
+
+        unsigned IndexBits = DL.getIndexTypeSizeInBits(Gep->getType());
+        APInt Offset(IndexBits, 0);
+        Value *Base = Gep->stripAndAccumulateConstantOffsets(DL, Offset, /* AllowNonInbounds */ true);
+        APInt InBoundsOffset(IndexBits, 0);
+        bool InBounds = Gep->stripAndAccumulateInBoundsConstantOffsets(DL, InBoundsOffset) == Base;
+        if (Base == Gep || Base->getType()->getPointerAddressSpace() != Gep->getAddressSpace())
+            return nullptr;
+        return createByteOffset(Base, Builder.getInt(Offset), Gep->getType(), InBounds, Builder);
+    }
+
+    // Both steps index the same type, so the order doesn't change the address. The new inner step can be
+    // out of bounds where the old one wasn't, so inbounds is dropped.
+    static Value *moveConstantOutward(GetElementPtrInst *Gep, IRBuilder<> &Builder) {
+        auto *Inner = dyn_cast<GetElementPtrInst>(Gep->getPointerOperand());
+        if (!Inner || !Inner->hasOneUse() || Gep->getNumIndices() != 1 || Inner->getNumIndices() != 1)
+            return nullptr;
+        if (Gep->getSourceElementType() != Inner->getSourceElementType())
+            return nullptr;
+        Value *Index = Gep->getOperand(1);
+        Value *InnerIndex = Inner->getOperand(1);
+        if (isa<Constant>(Index) || !isa<Constant>(InnerIndex) || Index->getType() != InnerIndex->getType())
+            return nullptr;
+        Type *ElementTy = Gep->getSourceElementType();
+        Value *Variable = Builder.CreateGEP(ElementTy, Inner->getPointerOperand(), Index);
+        return Builder.CreateGEP(ElementTy, Variable, InnerIndex);
+    }
+
+    static Value *foldIntToPtr(IntToPtrInst *Cast, IRBuilder<> &Builder, const DataLayout &DL) {
+        Value *Int = Cast->getOperand(0);
+        unsigned IntBits = Int->getType()->getScalarSizeInBits();
+        Value *Ptr = nullptr;
+        Value *Offset = nullptr;
+        if (match(Int, m_PtrToInt(m_Value(Ptr))) || match(Int, m_c_Add(m_PtrToInt(m_Value(Ptr)), m_Value(Offset)))) {
+            if (Ptr->getType()->getPointerAddressSpace() != Cast->getType()->getPointerAddressSpace())
+                return nullptr;
+            if (DL.getPointerTypeSizeInBits(Ptr->getType()) != IntBits || DL.getIndexTypeSizeInBits(Ptr->getType()) != IntBits)
+                return nullptr;
+            if (!Offset)
+                return Builder.CreatePointerCast(Ptr, Cast->getType());
+            return createByteOffset(Ptr, Offset, Cast->getType(), false, Builder);
+        }
+        return nullptr;
     }
 };
+
+template <typename PassT> void addCombinePass(FunctionPassManager &FPM) {
+    FPM.addPass(PassT());
 }
 
+const CombineStep CombineSteps[] = {
+    {"RHSMovePass", "rhs-move", addCombinePass<RHSMovePass>},
+    {"ConvertCompareInstructionsPass", "convert-compare", addCombinePass<ConvertCompareInstructionsPass>},
+    {"ReplaceCompareInstructionsPass", "replace-compare", addCombinePass<ReplaceCompareInstructionsPass>},
+    {"ReplaceSameOperandsAddWithShlPass", "same-operands-add-to-shl", addCombinePass<ReplaceSameOperandsAddWithShlPass>},
+    {"ReplacePowerOfTwoMullWithShlPass", "power-of-two-mul-to-shl", addCombinePass<ReplacePowerOfTwoMullWithShlPass>},
+    {"AllocaCountPass", "alloca-count", addCombinePass<AllocaCountPass>},
+    {"PatternCountPass", "pattern-count", addCombinePass<PatternCountPass>},
+    {"IncrementInstructionCombiningPass", "increment-combining", addCombinePass<IncrementInstructionCombiningPass>},
+    {"InitStoreCombiningPass", "init-store-combining", addCombinePass<InitStoreCombiningPass>},
+    {"StoreMergingPass", "store-merging", addCombinePass<StoreMergingPass>},
+    {"LoadCombiningPass", "load-combining", addCombinePass<LoadCombiningPass>},
+    {"CastFoldingPass", "cast-folding", addCombinePass<CastFoldingPass>},
+    {"SelectIdiomPass", "select-idiom", addCombinePass<SelectIdiomPass>},
+    {"FloatCombiningPass", "float-combining", addCombinePass<FloatCombiningPass>},
+    {"BitIdiomRecognitionPass", "bit-idiom", addCombinePass<BitIdiomRecognitionPass>},
+    {"KnownBitsSimplificationPass", "known-bits", addCombinePass<KnownBitsSimplificationPass>},
+    {"AddressFoldingPass", "address-folding", addCombinePass<AddressFoldingPass>},
+};
+
+// Marks a function the engine has combined. Like any function analysis it is dropped as soon as a pass changes the
+// function without preserving it, so a cached result means nothing touched the function since the engine's last run.
+struct CombinedAnalysis : public AnalysisInfoMixin<CombinedAnalysis> {
+    struct Result {};
+
+    Result run(Function &F, FunctionAnalysisManager &FAM) {
+        return Result();
+    }
+
+private:
+    friend AnalysisInfoMixin<CombinedAnalysis>;
+    static AnalysisKey Key;
+};
+
+AnalysisKey CombinedAnalysis::Key;
+
+// The whole engine: every rule that -combine-disable= leaves on. With -combine-incremental it skips the functions
+// whose CombinedAnalysis marker survived since it last ran, so running the engine again (at every peephole point,
+// or in both the compile and the LTO step) only costs time in the functions other passes changed in between.
+struct CombineEnginePass : public PassInfoMixin<CombineEnginePass> {
+    // clang -O0 marks every function optnone. The engine and its rules are what the user asked for, so they
+    // run there too, like -O0 keeps the always-inliner.
+    static bool isRequired() { return true; }
+
+    FunctionPassManager Rules;
+
+    CombineEnginePass() {
+        for (const CombineStep &Step : CombineSteps) {
+            if (!isCombineStepDisabled(Step))
+                Step.Add(Rules);
+        }
+    }
+
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        if (CombineIncremental && FAM.getCachedResult<CombinedAnalysis>(F)) {
+            CombineRemarks(F, FAM).analysis("Engine", &F.getEntryBlock().front(), "unchanged since the last run, not combined again");
+            return PreservedAnalyses::all();
+        }
+
+        // The pass manager has already invalidated whatever the rules changed, so the marker is computed on the result.
+        PreservedAnalyses PA = Rules.run(F, FAM);
+        if (CombineIncremental) {
+            FAM.getResult<CombinedAnalysis>(F);
+            PA.preserve<CombinedAnalysis>();
+        }
+        return PA;
+    }
+};
+
+}
+
+ArrayRef<CombineStep> getCombineSteps() {
+    return CombineSteps;
+}
+
+bool isCombineStepDisabled(const CombineStep &Step) {
+    return is_contained(CombineDisabled, Step.PipelineName);
+}
+
+void addCombinePasses(FunctionPassManager &FPM) {
+    FPM.addPass(CombineEnginePass());
+}
+
+void registerCombineAnalyses(FunctionAnalysisManager &FAM) {
+    FAM.registerPass([] { return CombinedAnalysis(); });
+}
+
+void resetCombineState() {
+    AllocaCounts.clear();
+    AllocaCounts.getAllocator().Reset();
+    PatternCounts.clear();
+    InitialStoredValues.clear();
+    InstructionsToRemove.clear();
+    ValuesMap.clear();
+}
 
 
 extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
@@ -593,17 +2526,64 @@ llvmGetPassPluginInfo() {
         .APIVersion = LLVM_PLUGIN_API_VERSION,
         .PluginName = "InstructionCombiningPass",
         .RegisterPassBuilderCallbacks = [](PassBuilder &PB) {
+            PB.registerAnalysisRegistrationCallback(registerCombineAnalyses);
+
+            // -passes=combine runs the engine, -passes=<rule> a single rule.
+            // require<combined> and invalidate<combined> set and clear the engine's marker by hand.
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM, ArrayRef<PassBuilder::PipelineElement>) {
+                    if (Name == "combine") {
+                        addCombinePasses(FPM);
+                        return true;
+                    }
+                    if (Name == "require<combined>") {
+                        FPM.addPass(RequireAnalysisPass<CombinedAnalysis, Function>());
+                        return true;
+                    }
+                    if (Name == "invalidate<combined>") {
+                        FPM.addPass(InvalidateAnalysisPass<CombinedAnalysis>());
+                        return true;
+                    }
+                    for (const CombineStep &Step : CombineSteps) {
+                        if (Name == Step.PipelineName) {
+                            Step.Add(FPM);
+                            return true;
+                        }
+                    }
+                    return false;
+                });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+                    if (Name == "combine") {
+                        // isHotBlock can only use a profile summary that is already there.
+                        MPM.addPass(RequireAnalysisPass<ProfileSummaryAnalysis, Module>());
+                        FunctionPassManager FPM;
+                        addCombinePasses(FPM);
+                        MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+                        return true;
+                    }
+                    return false;
+                });
+
             PB.registerPipelineStartEPCallback(
                 [](ModulePassManager &MPM, OptimizationLevel Level) {
-                    MPM.addPass(RHSMovePass());
-                    MPM.addPass(ConvertCompareInstructionsPass());
-                    MPM.addPass(ReplaceCompareInstructionsPass());
-                    MPM.addPass(ReplaceSameOperandsAddWithShlPass());
-                    MPM.addPass(ReplacePowerOfTwoMullWithShlPass());
-                    MPM.addPass(AllocaCountPass());
-                    MPM.addPass(PatternCountPass());
-                    MPM.addPass(IncrementInstructionCombiningPass());
-                    MPM.addPass(InitStoreCombiningPass());
+                    if (CombineEP != PipelineStartEP)
+                        return;
+                    MPM.addPass(RequireAnalysisPass<ProfileSummaryAnalysis, Module>());
+                    FunctionPassManager FPM;
+                    addCombinePasses(FPM);
+                    MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+                });
+            // From -O1 up both run after SROA, on SSA values instead of the loads and stores of the locals.
+            PB.registerPeepholeEPCallback(
+                [](FunctionPassManager &FPM, OptimizationLevel Level) {
+                    if (CombineEP == PeepholeEP)
+                        addCombinePasses(FPM);
+                });
+            PB.registerScalarOptimizerLateEPCallback(
+                [](FunctionPassManager &FPM, OptimizationLevel Level) {
+                    if (CombineEP == ScalarOptimizerLateEP)
+                        addCombinePasses(FPM);
                 });
         }
     };
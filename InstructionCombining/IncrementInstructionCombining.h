@@ -0,0 +1,29 @@
+#ifndef INCREMENT_INSTRUCTION_COMBINING_H
+#define INCREMENT_INSTRUCTION_COMBINING_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/PassManager.h"
+
+// What the plugin shares with the tools that run its rules outside of opt (see CombineReport.cpp).
+
+// A rule of the plugin, under the name the reports use and the name -passes= and -combine-disable= take.
+struct CombineStep {
+    const char *Name;
+    const char *PipelineName;
+    void (*Add)(llvm::FunctionPassManager &FPM);
+};
+
+// Every rule, in the order they have to run in.
+llvm::ArrayRef<CombineStep> getCombineSteps();
+bool isCombineStepDisabled(const CombineStep &Step);
+
+// Adds the combine engine: every rule -combine-disable= leaves on.
+void addCombinePasses(llvm::FunctionPassManager &FPM);
+// The engine needs its analyses in any FunctionAnalysisManager it runs with.
+void registerCombineAnalyses(llvm::FunctionAnalysisManager &FAM);
+
+// The counting passes leave their results in the globals for the passes after them.
+// Between two runs over different modules those results are stale and have to go.
+void resetCombineState();
+
+#endif
@@ -0,0 +1,53 @@
+#include <stdbool.h>
+
+// Kernels for combine-report -combine-benchmark: the patterns of the other examples, repeated n times in a loop.
+// Every kernel returns a value that depends on all of its work, so a wrong rewrite shows up as a mismatch.
+
+int bench_inc_xy(int n) {
+    int x = 0, y = 0;
+    for (int i = 0; i < n; i++) {
+        x++;
+        y++;
+        y++;
+        x++;
+    }
+    return x + y;
+}
+
+int bench_add_same_operands(int n) {
+    int sum = 0;
+    for (int i = 0; i < n; i++) {
+        int z = i + i;
+        sum += z;
+    }
+    return sum;
+}
+
+int bench_mull_pow_of_two(int n) {
+    int sum = 0;
+    for (int i = 0; i < n; i++) {
+        int z = i * 4;
+        int y = i * 8;
+        sum += z ^ y;
+    }
+    return sum;
+}
+
+int bench_comparisons(int n) {
+    int z = 0;
+    for (int i = 0; i < n; i++) {
+        int y = i & 7;
+        if (y > 0) {
+            z++;
+        }
+        if (y <= 0) {
+            z += 3;
+        }
+        bool a = (i & 1) != 0;
+        bool b = (i & 2) != 0;
+        if (a == b) {
+            z += 5;
+        }
+    }
+    return z;
+}
@@ -0,0 +1,35 @@
+# Runs INPUT through the plugin with PASSES (and OPT_ARGS) and checks that main still returns the same value.
+# Every "; CHECK: <regex>" line of INPUT has to match somewhere in the output, no "; CHECK-NOT: <regex>" line may.
+execute_process(COMMAND ${LLI} ${INPUT} RESULT_VARIABLE EXPECTED)
+
+separate_arguments(OPT_ARGS UNIX_COMMAND "${OPT_ARGS}")
+execute_process(COMMAND ${OPT} ${OPT_ARGS} -load-pass-plugin ${PLUGIN} -passes=${PASSES} -S ${INPUT} -o ${OUTPUT}
+                RESULT_VARIABLE OPT_RESULT ERROR_VARIABLE OPT_LOG)
+if(NOT OPT_RESULT EQUAL 0)
+  message(FATAL_ERROR "opt failed on ${INPUT}:\n${OPT_LOG}")
+endif()
+if(OPT_LOG MATCHES "is invalid!")
+  message(FATAL_ERROR "The plugin produced invalid IR for ${INPUT}:\n${OPT_LOG}")
+endif()
+
+execute_process(COMMAND ${LLI} ${OUTPUT} RESULT_VARIABLE ACTUAL)
+if(NOT ACTUAL STREQUAL EXPECTED)
+  message(FATAL_ERROR "main of ${INPUT} returned ${ACTUAL} after ${PASSES}, expected ${EXPECTED}")
+endif()
+
+file(READ ${OUTPUT} OUTPUT_IR)
+file(STRINGS ${INPUT} CHECKS REGEX "^; CHECK: ")
+foreach(CHECK ${CHECKS})
+  string(REGEX REPLACE "^; CHECK: " "" PATTERN "${CHECK}")
+  if(NOT OUTPUT_IR MATCHES "${PATTERN}")
+    message(FATAL_ERROR "${PATTERN} not found after ${PASSES}:\n${OUTPUT_IR}")
+  endif()
+endforeach()
+
+file(STRINGS ${INPUT} CHECK_NOTS REGEX "^; CHECK-NOT: ")
+foreach(CHECK_NOT ${CHECK_NOTS})
+  string(REGEX REPLACE "^; CHECK-NOT: " "" PATTERN "${CHECK_NOT}")
+  if(OUTPUT_IR MATCHES "${PATTERN}")
+    message(FATAL_ERROR "${PATTERN} found after ${PASSES}:\n${OUTPUT_IR}")
+  endif()
+endforeach()
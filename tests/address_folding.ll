@@ -0,0 +1,61 @@
+; Address arithmetic on a 4x4 table holding 0..15: main has to return 11 + 6 + 9 + 2 + 5 = 33.
+; Two GEPs with constant indices become one byte offset, and so does an add on a ptrtoint that goes back
+; through inttoptr. A constant step is moved outside a variable one, but only when nothing else uses it.
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-pc-linux-gnu"
+
+@table = dso_local global [4 x [4 x i32]] [[4 x i32] [i32 0, i32 1, i32 2, i32 3], [4 x i32] [i32 4, i32 5, i32 6, i32 7],
+                                           [4 x i32] [i32 8, i32 9, i32 10, i32 11], [4 x i32] [i32 12, i32 13, i32 14, i32 15]], align 16
+
+define dso_local i32 @constant_chain() {
+  %chain.row = getelementptr inbounds [4 x [4 x i32]], [4 x [4 x i32]]* @table, i64 0, i64 2
+  %chain.cell = getelementptr inbounds [4 x i32], [4 x i32]* %chain.row, i64 0, i64 3
+  %1 = load i32, i32* %chain.cell, align 4
+  ret i32 %1
+}
+
+define dso_local i32 @round_trip(i32* noundef %p) {
+  %trip.int = ptrtoint i32* %p to i64
+  %trip.sum = add i64 %trip.int, 8
+  %trip.ptr = inttoptr i64 %trip.sum to i32*
+  %1 = load i32, i32* %trip.ptr, align 4
+  ret i32 %1
+}
+
+define dso_local i32 @constant_outward(i32* noundef %p, i64 noundef %i) {
+  %outward.step = getelementptr i32, i32* %p, i64 1
+  %outward.cell = getelementptr i32, i32* %outward.step, i64 %i
+  %1 = load i32, i32* %outward.cell, align 4
+  ret i32 %1
+}
+
+define dso_local i32 @shared_step(i32* noundef %p, i64 noundef %i) {
+  %shared.step = getelementptr i32, i32* %p, i64 1
+  %shared.cell = getelementptr i32, i32* %shared.step, i64 %i
+  %1 = load i32, i32* %shared.cell, align 4
+  %2 = load i32, i32* %shared.step, align 4
+  %3 = sub nsw i32 %1, %2
+  ret i32 %3
+}
+
+define dso_local i32 @main() {
+  %row1 = getelementptr inbounds [4 x [4 x i32]], [4 x [4 x i32]]* @table, i64 0, i64 1, i64 0
+  %row2 = getelementptr inbounds [4 x [4 x i32]], [4 x [4 x i32]]* @table, i64 0, i64 2, i64 0
+  %1 = call i32 @constant_chain()
+  %2 = call i32 @round_trip(i32* %row1)
+  %3 = call i32 @constant_outward(i32* %row2, i64 0)
+  %4 = call i32 @shared_step(i32* %row2, i64 2)
+  %5 = call i32 @constant_outward(i32* %row1, i64 0)
+  %6 = add nsw i32 %1, %2
+  %7 = add nsw i32 %6, %3
+  %8 = add nsw i32 %7, %4
+  %9 = add nsw i32 %8, %5
+  ret i32 %9
+}
+; CHECK: getelementptr inbounds \(i8, i8\* bitcast \(\[4 x \[4 x i32\]\]\* @table to i8\*\), i64 44\)
+; CHECK: getelementptr i8, i8\* %[0-9]+, i64 8
+; CHECK: getelementptr i32, i32\* %p, i64 %i
+; CHECK: %shared.cell = getelementptr i32, i32\* %shared.step, i64 %i
+; CHECK-NOT: %chain.cell
+; CHECK-NOT: %trip.ptr
+; CHECK-NOT: %outward.step
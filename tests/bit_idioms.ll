@@ -0,0 +1,81 @@
+; Rotates and a population count loop: main has to return 16 + 4 + 1 + 0 + 1 = 22.
+; (x << 3) | (x >> 29) is a rotate, (x << 3) | (x >> 28) is not and stays.
+; The do-while that counts the set bits becomes ctpop when a guard keeps x == 0 out of it.
+; Without the guard it counts one for x == 0 where ctpop counts none, so that loop stays.
+
+define dso_local i32 @rotate(i32 noundef %x) {
+  %rot.left = shl i32 %x, 3
+  %rot.right = lshr i32 %x, 29
+  %rot = or i32 %rot.left, %rot.right
+  ret i32 %rot
+}
+
+define dso_local i32 @not_rotate(i32 noundef %x) {
+  %shift.left = shl i32 %x, 3
+  %shift.right = lshr i32 %x, 28
+  %shift = or i32 %shift.left, %shift.right
+  ret i32 %shift
+}
+
+define dso_local i32 @popcount(i32 noundef %x) {
+entry:
+  %nonzero = icmp ne i32 %x, 0
+  br i1 %nonzero, label %loop.ph, label %exit
+
+loop.ph:
+  br label %loop
+
+loop:
+  %xp = phi i32 [ %x, %loop.ph ], [ %xn, %loop ]
+  %c = phi i32 [ 0, %loop.ph ], [ %cn, %loop ]
+  %dec = add i32 %xp, -1
+  %xn = and i32 %xp, %dec
+  %cn = add nsw i32 %c, 1
+  %done = icmp eq i32 %xn, 0
+  br i1 %done, label %loop.exit, label %loop
+
+loop.exit:
+  %count = phi i32 [ %cn, %loop ]
+  br label %exit
+
+exit:
+  %result = phi i32 [ 0, %entry ], [ %count, %loop.exit ]
+  ret i32 %result
+}
+
+define dso_local i32 @unguarded(i32 noundef %x) {
+entry:
+  br label %loop
+
+loop:
+  %uxp = phi i32 [ %x, %entry ], [ %uxn, %loop ]
+  %uc = phi i32 [ 0, %entry ], [ %ucn, %loop ]
+  %udec = add i32 %uxp, -1
+  %uxn = and i32 %uxp, %udec
+  %ucn = add nsw i32 %uc, 1
+  %udone = icmp eq i32 %uxn, 0
+  br i1 %udone, label %exit, label %loop
+
+exit:
+  %ucount = phi i32 [ %ucn, %loop ]
+  ret i32 %ucount
+}
+
+define dso_local i32 @main() {
+  %1 = call i32 @rotate(i32 2)
+  %2 = call i32 @popcount(i32 15)
+  %3 = call i32 @unguarded(i32 0)
+  %4 = call i32 @not_rotate(i32 0)
+  %5 = call i32 @unguarded(i32 8)
+  %6 = add nsw i32 %1, %2
+  %7 = add nsw i32 %6, %3
+  %8 = add nsw i32 %7, %4
+  %9 = add nsw i32 %8, %5
+  ret i32 %9
+}
+; CHECK: call i32 @llvm.fshl.i32\(i32 %x, i32 %x, i32 3\)
+; CHECK: %shift = or i32 %shift.left, %shift.right
+; CHECK: call i32 @llvm.ctpop.i32\(i32 %x\)
+; CHECK: %uxn = and i32 %uxp, %udec
+; CHECK-NOT: %rot =
+; CHECK-NOT: %dec =
@@ -0,0 +1,49 @@
+; a == b and a != b on two C bools become a xor of the i1 values, so the result keeps the i1 type of the compare.
+; eq(1, 1) is 1, ne(1, 0) is 1 and eq(1, 0) is 0, so main returns 1 + 2.
+; CHECK: xor i1
+
+define dso_local zeroext i1 @eq(i1 noundef zeroext %a, i1 noundef zeroext %b) {
+  %1 = alloca i8, align 1
+  %2 = alloca i8, align 1
+  %3 = zext i1 %a to i8
+  store i8 %3, i8* %1, align 1
+  %4 = zext i1 %b to i8
+  store i8 %4, i8* %2, align 1
+  %5 = load i8, i8* %1, align 1
+  %6 = trunc i8 %5 to i1
+  %7 = zext i1 %6 to i32
+  %8 = load i8, i8* %2, align 1
+  %9 = trunc i8 %8 to i1
+  %10 = zext i1 %9 to i32
+  %11 = icmp eq i32 %7, %10
+  ret i1 %11
+}
+
+define dso_local zeroext i1 @ne(i1 noundef zeroext %a, i1 noundef zeroext %b) {
+  %1 = alloca i8, align 1
+  %2 = alloca i8, align 1
+  %3 = zext i1 %a to i8
+  store i8 %3, i8* %1, align 1
+  %4 = zext i1 %b to i8
+  store i8 %4, i8* %2, align 1
+  %5 = load i8, i8* %1, align 1
+  %6 = trunc i8 %5 to i1
+  %7 = zext i1 %6 to i32
+  %8 = load i8, i8* %2, align 1
+  %9 = trunc i8 %8 to i1
+  %10 = zext i1 %9 to i32
+  %11 = icmp ne i32 %7, %10
+  ret i1 %11
+}
+
+define dso_local i32 @main() {
+  %1 = call zeroext i1 @eq(i1 true, i1 true)
+  %2 = call zeroext i1 @ne(i1 true, i1 false)
+  %3 = call zeroext i1 @eq(i1 true, i1 false)
+  %4 = zext i1 %1 to i32
+  %5 = select i1 %2, i32 2, i32 0
+  %6 = select i1 %3, i32 4, i32 0
+  %7 = or i32 %4, %5
+  %8 = or i32 %7, %6
+  ret i32 %8
+}
@@ -0,0 +1,62 @@
+; Cast chains: main has to return 200 + 9 + 1 + 1 = 211.
+; zext(zext x) becomes one zext, trunc(zext x) is x and an unsigned compare of two zexts is done on i8.
+; A signed compare of zexts stays, done on i8 it would take 200 for a negative number.
+; zext(sext x) is not one extension, so it stays too.
+
+define dso_local i32 @chain(i8 noundef %x) {
+  %chain.narrow = zext i8 %x to i16
+  %chain.wide = zext i16 %chain.narrow to i32
+  ret i32 %chain.wide
+}
+
+define dso_local i8 @round_trip(i8 noundef %x) {
+  %round.wide = zext i8 %x to i32
+  %round.narrow = trunc i32 %round.wide to i8
+  ret i8 %round.narrow
+}
+
+define dso_local i1 @unsigned_less(i8 noundef %a, i8 noundef %b) {
+  %ult.a = zext i8 %a to i32
+  %ult.b = zext i8 %b to i32
+  %ult = icmp ult i32 %ult.a, %ult.b
+  ret i1 %ult
+}
+
+define dso_local i1 @signed_less(i8 noundef %a, i8 noundef %b) {
+  %slt.a = zext i8 %a to i32
+  %slt.b = zext i8 %b to i32
+  %slt = icmp slt i32 %slt.a, %slt.b
+  ret i1 %slt
+}
+
+define dso_local i32 @mixed(i8 noundef %x) {
+  %mixed.narrow = sext i8 %x to i16
+  %mixed.wide = zext i16 %mixed.narrow to i32
+  ret i32 %mixed.wide
+}
+
+define dso_local i32 @main() {
+  %1 = call i32 @chain(i8 200)
+  %2 = call i8 @round_trip(i8 9)
+  %3 = zext i8 %2 to i32
+  %4 = call i1 @unsigned_less(i8 3, i8 200)
+  %5 = zext i1 %4 to i32
+  %6 = call i1 @signed_less(i8 3, i8 200)
+  %7 = zext i1 %6 to i32
+  %8 = call i32 @mixed(i8 -1)
+  %9 = icmp eq i32 %8, 65535
+  %10 = zext i1 %9 to i32
+  %11 = sub nsw i32 %10, 1
+  %12 = add nsw i32 %1, %3
+  %13 = add nsw i32 %12, %5
+  %14 = add nsw i32 %13, %7
+  %15 = add nsw i32 %14, %11
+  ret i32 %15
+}
+; CHECK: zext i8 %x to i32
+; CHECK: ret i8 %x
+; CHECK: icmp ult i8 %a, %b
+; CHECK: %slt = icmp slt i32 %slt.a, %slt.b
+; CHECK: %mixed.wide = zext i16 %mixed.narrow to i32
+; CHECK-NOT: %chain.narrow
+; CHECK-NOT: %round.narrow
@@ -0,0 +1,36 @@
+; A trailing zero count loop that may start at zero, in a function that is not mustprogress: main has to return 3.
+; trailing_zeros(0) would loop forever, and a cttz would return 32 instead, so the loop has to stay.
+
+define dso_local i32 @trailing_zeros(i32 noundef %x) {
+entry:
+  %low = and i32 %x, 1
+  %even = icmp eq i32 %low, 0
+  br i1 %even, label %loop.ph, label %exit
+
+loop.ph:
+  br label %loop
+
+loop:
+  %xp = phi i32 [ %x, %loop.ph ], [ %xn, %loop ]
+  %c = phi i32 [ 0, %loop.ph ], [ %cn, %loop ]
+  %xn = lshr i32 %xp, 1
+  %cn = add nsw i32 %c, 1
+  %bit = and i32 %xn, 1
+  %odd = icmp ne i32 %bit, 0
+  br i1 %odd, label %loop.exit, label %loop
+
+loop.exit:
+  %count = phi i32 [ %cn, %loop ]
+  br label %exit
+
+exit:
+  %result = phi i32 [ 0, %entry ], [ %count, %loop.exit ]
+  ret i32 %result
+}
+
+define dso_local i32 @main() {
+  %1 = call i32 @trailing_zeros(i32 8)
+  ret i32 %1
+}
+; CHECK-NOT: llvm.cttz
+; CHECK: lshr i32 %xp, 1
@@ -0,0 +1,40 @@
+; A trailing zero count loop in a mustprogress function: main has to return 3 + 0 + 5 = 8.
+; The guard only checks that x is even, so x == 0 would loop forever. mustprogress makes that undefined,
+; so the loop becomes a cttz.
+
+define dso_local i32 @trailing_zeros(i32 noundef %x) mustprogress {
+entry:
+  %low = and i32 %x, 1
+  %even = icmp eq i32 %low, 0
+  br i1 %even, label %loop.ph, label %exit
+
+loop.ph:
+  br label %loop
+
+loop:
+  %xp = phi i32 [ %x, %loop.ph ], [ %xn, %loop ]
+  %c = phi i32 [ 0, %loop.ph ], [ %cn, %loop ]
+  %xn = lshr i32 %xp, 1
+  %cn = add nsw i32 %c, 1
+  %bit = and i32 %xn, 1
+  %odd = icmp ne i32 %bit, 0
+  br i1 %odd, label %loop.exit, label %loop
+
+loop.exit:
+  %count = phi i32 [ %cn, %loop ]
+  br label %exit
+
+exit:
+  %result = phi i32 [ 0, %entry ], [ %count, %loop.exit ]
+  ret i32 %result
+}
+
+define dso_local i32 @main() {
+  %1 = call i32 @trailing_zeros(i32 8)
+  %2 = call i32 @trailing_zeros(i32 7)
+  %3 = call i32 @trailing_zeros(i32 96)
+  %4 = add nsw i32 %1, %2
+  %5 = add nsw i32 %4, %3
+  ret i32 %5
+}
+; CHECK: call i32 @llvm.cttz.i32
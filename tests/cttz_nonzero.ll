@@ -0,0 +1,38 @@
+; A trailing zero count loop on x | 64, which is never zero: main has to return 3 + 6 = 9.
+; The function is not mustprogress, but with a non-zero start the loop always ends, so it becomes a cttz.
+
+define dso_local i32 @trailing_zeros(i32 noundef %x) {
+entry:
+  %y = or i32 %x, 64
+  %low = and i32 %y, 1
+  %even = icmp eq i32 %low, 0
+  br i1 %even, label %loop.ph, label %exit
+
+loop.ph:
+  br label %loop
+
+loop:
+  %xp = phi i32 [ %y, %loop.ph ], [ %xn, %loop ]
+  %c = phi i32 [ 0, %loop.ph ], [ %cn, %loop ]
+  %xn = lshr i32 %xp, 1
+  %cn = add nsw i32 %c, 1
+  %bit = and i32 %xn, 1
+  %odd = icmp ne i32 %bit, 0
+  br i1 %odd, label %loop.exit, label %loop
+
+loop.exit:
+  %count = phi i32 [ %cn, %loop ]
+  br label %exit
+
+exit:
+  %result = phi i32 [ 0, %entry ], [ %count, %loop.exit ]
+  ret i32 %result
+}
+
+define dso_local i32 @main() {
+  %1 = call i32 @trailing_zeros(i32 8)
+  %2 = call i32 @trailing_zeros(i32 0)
+  %3 = add nsw i32 %1, %2
+  ret i32 %3
+}
+; CHECK: call i32 @llvm.cttz.i32
@@ -0,0 +1,25 @@
+; A rule that removes the last load of a local also removes the local: main has to return 7.
+; and (load %a), 0 is 0, so %a is only stored to afterwards and goes away with its stores and the add feeding them.
+; %b is still loaded for the result, so it stays.
+
+define dso_local i32 @masked(i32 noundef %x, i32 noundef %y) {
+  %a = alloca i32, align 4
+  %b = alloca i32, align 4
+  %a.value = add nsw i32 %x, 1
+  store i32 %a.value, i32* %a, align 4
+  store i32 %y, i32* %b, align 4
+  %1 = load i32, i32* %a, align 4
+  %2 = and i32 %1, 0
+  %3 = load i32, i32* %b, align 4
+  %4 = add nsw i32 %2, %3
+  ret i32 %4
+}
+
+define dso_local i32 @main() {
+  %1 = call i32 @masked(i32 5, i32 7)
+  ret i32 %1
+}
+; CHECK: %b = alloca i32
+; CHECK: store i32 %y, i32\* %b
+; CHECK-NOT: %a = alloca
+; CHECK-NOT: %a.value
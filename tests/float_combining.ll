@@ -0,0 +1,61 @@
+; Float rules that depend on the fast-math flags: main has to return 3 + 4 + 4 + 72 + 17 = 100.
+; x / 4.0 is x * 0.25 without any flag, x / 3.0 only becomes a multiply with arcp.
+; (x * 2.0) * 3.0 is x * 6.0 with reassoc. (x + 2.0) + 3.0 also needs nsz, so without it that one stays.
+
+define dso_local double @quarter(double noundef %x) {
+  %quarter = fdiv double %x, 4.000000e+00
+  ret double %quarter
+}
+
+define dso_local double @third(double noundef %x) {
+  %third = fdiv double %x, 3.000000e+00
+  ret double %third
+}
+
+define dso_local double @third_arcp(double noundef %x) {
+  %third.arcp = fdiv arcp double %x, 3.000000e+00
+  ret double %third.arcp
+}
+
+define dso_local double @scale(double noundef %x) {
+  %scale.inner = fmul reassoc double %x, 2.000000e+00
+  %scale = fmul reassoc double %scale.inner, 3.000000e+00
+  ret double %scale
+}
+
+define dso_local double @offset(double noundef %x) {
+  %offset.inner = fadd reassoc double %x, 2.000000e+00
+  %offset = fadd reassoc double %offset.inner, 3.000000e+00
+  ret double %offset
+}
+
+define dso_local i32 @round(double noundef %x) {
+  %1 = fadd double %x, 5.000000e-01
+  %2 = fptosi double %1 to i32
+  ret i32 %2
+}
+
+define dso_local i32 @main() {
+  %1 = call double @quarter(double 1.200000e+01)
+  %2 = call double @third(double 1.200000e+01)
+  %3 = call double @third_arcp(double 1.200000e+01)
+  %4 = call double @scale(double 1.200000e+01)
+  %5 = call double @offset(double 1.200000e+01)
+  %6 = call i32 @round(double %1)
+  %7 = call i32 @round(double %2)
+  %8 = call i32 @round(double %3)
+  %9 = call i32 @round(double %4)
+  %10 = call i32 @round(double %5)
+  %11 = add nsw i32 %6, %7
+  %12 = add nsw i32 %11, %8
+  %13 = add nsw i32 %12, %9
+  %14 = add nsw i32 %13, %10
+  ret i32 %14
+}
+; CHECK: fmul double %x, 2.500000e-01
+; CHECK: %third = fdiv double %x, 3.000000e\+00
+; CHECK: fmul arcp double %x, 0x3FD5555555555555
+; CHECK: fmul reassoc double %x, 6.000000e\+00
+; CHECK: %offset = fadd reassoc double %offset.inner, 3.000000e\+00
+; CHECK-NOT: %third.arcp
+; CHECK-NOT: %scale.inner
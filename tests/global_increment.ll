@@ -0,0 +1,22 @@
+; g++ on a global next to x++ on a local, as clang -O0 emits it: main has to return 2.
+; Only the local is merged into its initial store, so the increment of the global has to stay.
+
+@g = dso_local global i32 0, align 4
+
+define dso_local i32 @main() {
+  %1 = alloca i32, align 4
+  %2 = alloca i32, align 4
+  store i32 0, i32* %1, align 4
+  store i32 0, i32* %2, align 4
+  %3 = load i32, i32* @g, align 4
+  %4 = add nsw i32 %3, 1
+  store i32 %4, i32* @g, align 4
+  %5 = load i32, i32* %2, align 4
+  %6 = add nsw i32 %5, 1
+  store i32 %6, i32* %2, align 4
+  %7 = load i32, i32* @g, align 4
+  %8 = load i32, i32* %2, align 4
+  %9 = add nsw i32 %7, %8
+  ret i32 %9
+}
+; CHECK: store i32 %[0-9]+, i32\* @g
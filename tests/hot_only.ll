@@ -0,0 +1,28 @@
+; With -combine-hot-only the cast chain in the rarely taken block stays, the one in the entry block is folded.
+; main has to return 3 + 4 = 7.
+
+define dso_local i32 @widen(i8 noundef %x, i8 noundef %y, i1 %rare) {
+entry:
+  %hot.narrow = zext i8 %x to i16
+  %hot.wide = zext i16 %hot.narrow to i32
+  br i1 %rare, label %cold, label %exit, !prof !0
+
+cold:
+  %cold.narrow = zext i8 %y to i16
+  %cold.wide = zext i16 %cold.narrow to i32
+  %sum = add nsw i32 %hot.wide, %cold.wide
+  br label %exit
+
+exit:
+  %result = phi i32 [ %hot.wide, %entry ], [ %sum, %cold ]
+  ret i32 %result
+}
+
+define dso_local i32 @main() {
+  %1 = call i32 @widen(i8 3, i8 4, i1 true)
+  ret i32 %1
+}
+
+!0 = !{!"branch_weights", i32 1, i32 1000}
+; CHECK: %cold.wide = zext i16 %cold.narrow to i32
+; CHECK-NOT: %hot.narrow
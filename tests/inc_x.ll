@@ -0,0 +1,19 @@
+; examples/inc_x.c as clang -O0 emits it, with a main that checks the result: inc(40) has to return 42.
+
+define dso_local i32 @inc(i32 noundef %0) {
+  %2 = alloca i32, align 4
+  store i32 %0, i32* %2, align 4
+  %3 = load i32, i32* %2, align 4
+  %4 = add nsw i32 %3, 1
+  store i32 %4, i32* %2, align 4
+  %5 = load i32, i32* %2, align 4
+  %6 = add nsw i32 %5, 1
+  store i32 %6, i32* %2, align 4
+  %7 = load i32, i32* %2, align 4
+  ret i32 %7
+}
+
+define dso_local i32 @main() {
+  %1 = call i32 @inc(i32 40)
+  ret i32 %1
+}
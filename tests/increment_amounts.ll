@@ -0,0 +1,47 @@
+; Only the constant increments are merged, x += n has to stay where it is.
+; inc(4, 10) is 4 + 1 + 10 + 1 and init(20) is 0 + 1 + 20 + 1, so main returns 16 + 22.
+
+define dso_local i32 @inc(i32 noundef %0, i32 noundef %1) {
+  %3 = alloca i32, align 4
+  %4 = alloca i32, align 4
+  store i32 %0, i32* %3, align 4
+  store i32 %1, i32* %4, align 4
+  %5 = load i32, i32* %3, align 4
+  %6 = add nsw i32 %5, 1
+  store i32 %6, i32* %3, align 4
+  %7 = load i32, i32* %4, align 4
+  %8 = load i32, i32* %3, align 4
+  %9 = add nsw i32 %8, %7
+  store i32 %9, i32* %3, align 4
+  %10 = load i32, i32* %3, align 4
+  %11 = add nsw i32 %10, 1
+  store i32 %11, i32* %3, align 4
+  %12 = load i32, i32* %3, align 4
+  ret i32 %12
+}
+
+define dso_local i32 @init(i32 noundef %0) {
+  %2 = alloca i32, align 4
+  %3 = alloca i32, align 4
+  store i32 %0, i32* %2, align 4
+  store i32 0, i32* %3, align 4
+  %4 = load i32, i32* %3, align 4
+  %5 = add nsw i32 %4, 1
+  store i32 %5, i32* %3, align 4
+  %6 = load i32, i32* %2, align 4
+  %7 = load i32, i32* %3, align 4
+  %8 = add nsw i32 %7, %6
+  store i32 %8, i32* %3, align 4
+  %9 = load i32, i32* %3, align 4
+  %10 = add nsw i32 %9, 1
+  store i32 %10, i32* %3, align 4
+  %11 = load i32, i32* %3, align 4
+  ret i32 %11
+}
+
+define dso_local i32 @main() {
+  %1 = call i32 @inc(i32 4, i32 10)
+  %2 = call i32 @init(i32 20)
+  %3 = add i32 %1, %2
+  ret i32 %3
+}
@@ -0,0 +1,14 @@
+; twice is marked as combined, but invalidate<combined> drops the marker the way a pass that changes the function
+; does. The engine has to run on it again and turn x + x into a shift. main has to return 10.
+
+define dso_local i32 @twice(i32 noundef %x) {
+  %sum = add i32 %x, %x
+  ret i32 %sum
+}
+
+define dso_local i32 @main() {
+  %1 = call i32 @twice(i32 5)
+  ret i32 %1
+}
+; CHECK: shl i32 %x, 1
+; CHECK-NOT: %sum = add
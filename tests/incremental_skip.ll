@@ -0,0 +1,13 @@
+; require<combined> marks twice as already combined and nothing changes it before the engine runs,
+; so the engine skips it and x + x stays an add. main has to return 10.
+
+define dso_local i32 @twice(i32 noundef %x) {
+  %sum = add i32 %x, %x
+  ret i32 %sum
+}
+
+define dso_local i32 @main() {
+  %1 = call i32 @twice(i32 5)
+  ret i32 %1
+}
+; CHECK: %sum = add i32 %x, %x
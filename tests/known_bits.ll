@@ -0,0 +1,52 @@
+; Known-bits rules: main has to return 1 + 100 + 100 + 2 + 1 = 204.
+; and (zext i16 a), (zext i8 b) fits in i16 and is done there. lshr (shl (zext y), 8), 8 is zext y, because the
+; bits shifted out are known zero. The same pair on an unknown x loses its top byte, so it stays.
+; The sum of two zexts from i8 needs 9 bits, which is no narrower than an i16 that has to be made first, so it stays.
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-pc-linux-gnu"
+
+define dso_local i32 @narrow_and(i16 noundef %a, i8 noundef %b) {
+  %and.a = zext i16 %a to i32
+  %and.b = zext i8 %b to i32
+  %and = and i32 %and.a, %and.b
+  ret i32 %and
+}
+
+define dso_local i32 @shift_back(i8 noundef %y) {
+  %back.wide = zext i8 %y to i32
+  %back.up = shl i32 %back.wide, 8
+  %back = lshr i32 %back.up, 8
+  ret i32 %back
+}
+
+define dso_local i32 @shift_lost(i32 noundef %x) {
+  %lost.up = shl i32 %x, 8
+  %lost = lshr i32 %lost.up, 8
+  ret i32 %lost
+}
+
+define dso_local i32 @wide_add(i8 noundef %a, i8 noundef %b) {
+  %add.a = zext i8 %a to i32
+  %add.b = zext i8 %b to i32
+  %add = add nuw nsw i32 %add.a, %add.b
+  ret i32 %add
+}
+
+define dso_local i32 @main() {
+  %1 = call i32 @narrow_and(i16 257, i8 3)
+  %2 = call i32 @shift_back(i8 100)
+  %3 = call i32 @shift_lost(i32 16777316)
+  %4 = call i32 @wide_add(i8 1, i8 1)
+  %5 = call i32 @wide_add(i8 0, i8 1)
+  %6 = add nsw i32 %1, %2
+  %7 = add nsw i32 %6, %3
+  %8 = add nsw i32 %7, %4
+  %9 = add nsw i32 %8, %5
+  ret i32 %9
+}
+; CHECK: and i16 %a, %[0-9]+
+; CHECK: ret i32 %back.wide
+; CHECK: %lost = lshr i32 %lost.up, 8
+; CHECK: %add = add nuw nsw i32 %add.a, %add.b
+; CHECK-NOT: %and =
+; CHECK-NOT: %back.up
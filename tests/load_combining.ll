@@ -0,0 +1,96 @@
+; Byte-wise reads of a 4-byte array: main has to return 7 when all three read the right value.
+; The little-endian order becomes one i32 load, the big-endian order a load and a bswap.
+; The third one puts the bytes in neither order, so it is left alone.
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-pc-linux-gnu"
+
+@bytes = dso_local global [4 x i8] c"\01\02\03\04", align 4
+
+define dso_local i32 @little() {
+  %little.p0 = getelementptr inbounds [4 x i8], [4 x i8]* @bytes, i64 0, i64 0
+  %little.b0 = load i8, i8* %little.p0, align 4
+  %little.w0 = zext i8 %little.b0 to i32
+  %little.p1 = getelementptr inbounds [4 x i8], [4 x i8]* @bytes, i64 0, i64 1
+  %little.b1 = load i8, i8* %little.p1, align 1
+  %little.w1 = zext i8 %little.b1 to i32
+  %little.s1 = shl i32 %little.w1, 8
+  %little.p2 = getelementptr inbounds [4 x i8], [4 x i8]* @bytes, i64 0, i64 2
+  %little.b2 = load i8, i8* %little.p2, align 1
+  %little.w2 = zext i8 %little.b2 to i32
+  %little.s2 = shl i32 %little.w2, 16
+  %little.p3 = getelementptr inbounds [4 x i8], [4 x i8]* @bytes, i64 0, i64 3
+  %little.b3 = load i8, i8* %little.p3, align 1
+  %little.w3 = zext i8 %little.b3 to i32
+  %little.s3 = shl i32 %little.w3, 24
+  %little.o1 = or i32 %little.w0, %little.s1
+  %little.o2 = or i32 %little.o1, %little.s2
+  %little.o3 = or i32 %little.o2, %little.s3
+  ret i32 %little.o3
+}
+
+define dso_local i32 @big() {
+  %big.p0 = getelementptr inbounds [4 x i8], [4 x i8]* @bytes, i64 0, i64 0
+  %big.b0 = load i8, i8* %big.p0, align 4
+  %big.w0 = zext i8 %big.b0 to i32
+  %big.s0 = shl i32 %big.w0, 24
+  %big.p1 = getelementptr inbounds [4 x i8], [4 x i8]* @bytes, i64 0, i64 1
+  %big.b1 = load i8, i8* %big.p1, align 1
+  %big.w1 = zext i8 %big.b1 to i32
+  %big.s1 = shl i32 %big.w1, 16
+  %big.p2 = getelementptr inbounds [4 x i8], [4 x i8]* @bytes, i64 0, i64 2
+  %big.b2 = load i8, i8* %big.p2, align 1
+  %big.w2 = zext i8 %big.b2 to i32
+  %big.s2 = shl i32 %big.w2, 8
+  %big.p3 = getelementptr inbounds [4 x i8], [4 x i8]* @bytes, i64 0, i64 3
+  %big.b3 = load i8, i8* %big.p3, align 1
+  %big.w3 = zext i8 %big.b3 to i32
+  %big.o1 = or i32 %big.s0, %big.s1
+  %big.o2 = or i32 %big.o1, %big.s2
+  %big.o3 = or i32 %big.o2, %big.w3
+  ret i32 %big.o3
+}
+
+define dso_local i32 @mixed() {
+  %mixed.p0 = getelementptr inbounds [4 x i8], [4 x i8]* @bytes, i64 0, i64 0
+  %mixed.b0 = load i8, i8* %mixed.p0, align 4
+  %mixed.w0 = zext i8 %mixed.b0 to i32
+  %mixed.p1 = getelementptr inbounds [4 x i8], [4 x i8]* @bytes, i64 0, i64 1
+  %mixed.b1 = load i8, i8* %mixed.p1, align 1
+  %mixed.w1 = zext i8 %mixed.b1 to i32
+  %mixed.s1 = shl i32 %mixed.w1, 16
+  %mixed.p2 = getelementptr inbounds [4 x i8], [4 x i8]* @bytes, i64 0, i64 2
+  %mixed.b2 = load i8, i8* %mixed.p2, align 1
+  %mixed.w2 = zext i8 %mixed.b2 to i32
+  %mixed.s2 = shl i32 %mixed.w2, 8
+  %mixed.p3 = getelementptr inbounds [4 x i8], [4 x i8]* @bytes, i64 0, i64 3
+  %mixed.b3 = load i8, i8* %mixed.p3, align 1
+  %mixed.w3 = zext i8 %mixed.b3 to i32
+  %mixed.s3 = shl i32 %mixed.w3, 24
+  %mixed.o1 = or i32 %mixed.w0, %mixed.s1
+  %mixed.o2 = or i32 %mixed.o1, %mixed.s2
+  %mixed.o3 = or i32 %mixed.o2, %mixed.s3
+  ret i32 %mixed.o3
+}
+
+define dso_local i32 @main() {
+  %1 = call i32 @little()
+  %2 = call i32 @big()
+  %3 = call i32 @mixed()
+  %4 = icmp eq i32 %1, 67305985
+  %5 = icmp eq i32 %2, 16909060
+  %6 = icmp eq i32 %3, 67240705
+  %7 = zext i1 %4 to i32
+  %8 = zext i1 %5 to i32
+  %9 = zext i1 %6 to i32
+  %10 = shl i32 %8, 1
+  %11 = shl i32 %9, 2
+  %12 = or i32 %7, %10
+  %13 = or i32 %12, %11
+  ret i32 %13
+}
+; CHECK: bitcast i8\* %little.p0 to i32\*
+; CHECK: bitcast i8\* %big.p0 to i32\*
+; CHECK: call i32 @llvm.bswap.i32
+; CHECK: %mixed.o3 = or i32 %mixed.o2, %mixed.s3
+; CHECK-NOT: %little.o3
+; CHECK-NOT: %big.o3
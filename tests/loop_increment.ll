@@ -0,0 +1,33 @@
+; Increments in a loop body run once per iteration, merging them into the initial store like straight-line code
+; would count them once. count(4) increments x four times in the loop and once after it, so main returns 5.
+
+define dso_local i32 @count(i32 noundef %n) {
+entry:
+  %x = alloca i32, align 4
+  %left = alloca i32, align 4
+  store i32 0, i32* %x, align 4
+  store i32 %n, i32* %left, align 4
+  br label %loop
+
+loop:
+  %0 = load i32, i32* %left, align 4
+  %1 = sub nsw i32 %0, 1
+  store i32 %1, i32* %left, align 4
+  %more = icmp sgt i32 %1, 0
+  %2 = load i32, i32* %x, align 4
+  %3 = add nsw i32 %2, 1
+  store i32 %3, i32* %x, align 4
+  br i1 %more, label %loop, label %exit
+
+exit:
+  %4 = load i32, i32* %x, align 4
+  %5 = add nsw i32 %4, 1
+  store i32 %5, i32* %x, align 4
+  %6 = load i32, i32* %x, align 4
+  ret i32 %6
+}
+
+define dso_local i32 @main() {
+  %1 = call i32 @count(i32 4)
+  ret i32 %1
+}
@@ -0,0 +1,14 @@
+; clang -O0 marks every function optnone, the rules have to run there anyway.
+; CHECK: shl i32 %x, 1
+
+define dso_local i32 @twice(i32 noundef %x) #0 {
+  %1 = add nsw i32 %x, %x
+  ret i32 %1
+}
+
+define dso_local i32 @main() #0 {
+  %1 = call i32 @twice(i32 21)
+  ret i32 %1
+}
+
+attributes #0 = { noinline nounwind optnone }
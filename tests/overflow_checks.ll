@@ -0,0 +1,57 @@
+; Hand-written overflow checks: main has to return 1 + 2 + 4 + 8 + 0 = 15, one bit per call.
+; a + b < a, a - b > a and (a * b) / a != b become the overflow bit of uadd, usub and umul.with.overflow.
+; a + b < c compares against a value the add didn't use, so it stays.
+
+define dso_local i1 @add_overflows(i32 noundef %a, i32 noundef %b) {
+  %add.sum = add i32 %a, %b
+  %add.check = icmp ult i32 %add.sum, %a
+  ret i1 %add.check
+}
+
+define dso_local i1 @sub_overflows(i32 noundef %a, i32 noundef %b) {
+  %sub.diff = sub i32 %a, %b
+  %sub.check = icmp ugt i32 %sub.diff, %a
+  ret i1 %sub.check
+}
+
+define dso_local i1 @mul_overflows(i32 noundef %a, i32 noundef %b) {
+  %mul.product = mul i32 %a, %b
+  %mul.quotient = udiv i32 %mul.product, %a
+  %mul.check = icmp ne i32 %mul.quotient, %b
+  ret i1 %mul.check
+}
+
+define dso_local i1 @sum_below(i32 noundef %a, i32 noundef %b, i32 noundef %c) {
+  %below.sum = add i32 %a, %b
+  %below.check = icmp ult i32 %below.sum, %c
+  ret i1 %below.check
+}
+
+define dso_local i32 @main() {
+  %1 = call i1 @add_overflows(i32 -1, i32 2)
+  %2 = call i1 @sub_overflows(i32 1, i32 2)
+  %3 = call i1 @mul_overflows(i32 65536, i32 65536)
+  %4 = call i1 @sum_below(i32 1, i32 2, i32 4)
+  %5 = call i1 @add_overflows(i32 1, i32 2)
+  %6 = zext i1 %1 to i32
+  %7 = zext i1 %2 to i32
+  %8 = zext i1 %3 to i32
+  %9 = zext i1 %4 to i32
+  %10 = zext i1 %5 to i32
+  %11 = shl i32 %7, 1
+  %12 = shl i32 %8, 2
+  %13 = shl i32 %9, 3
+  %14 = shl i32 %10, 4
+  %15 = or i32 %6, %11
+  %16 = or i32 %15, %12
+  %17 = or i32 %16, %13
+  %18 = or i32 %17, %14
+  ret i32 %18
+}
+; CHECK: call { i32, i1 } @llvm.uadd.with.overflow.i32\(i32 %a, i32 %b\)
+; CHECK: call { i32, i1 } @llvm.usub.with.overflow.i32\(i32 %a, i32 %b\)
+; CHECK: call { i32, i1 } @llvm.umul.with.overflow.i32\(i32 %a, i32 %b\)
+; CHECK: %below.check = icmp ult i32 %below.sum, %c
+; CHECK-NOT: %add.check
+; CHECK-NOT: %sub.check
+; CHECK-NOT: %mul.check
@@ -0,0 +1,21 @@
+; Only x + x is x << 1. Values that aren't loads have no source variable, which must not make them all the same.
+; next(5) is 6 and twice(5) is 10, so main returns 16.
+; CHECK: add i32 %c, 1
+; CHECK: shl i32 %x, 1
+
+define dso_local i32 @next(i32 noundef %c) {
+  %1 = add i32 %c, 1
+  ret i32 %1
+}
+
+define dso_local i32 @twice(i32 noundef %x) {
+  %1 = add i32 %x, %x
+  ret i32 %1
+}
+
+define dso_local i32 @main() {
+  %1 = call i32 @next(i32 5)
+  %2 = call i32 @twice(i32 5)
+  %3 = add i32 %1, %2
+  ret i32 %3
+}
@@ -0,0 +1,53 @@
+; Selects that pick one of the compared values: main has to return 9 + 3 + 5 + 6 + 4 = 27.
+; a > b ? a : b is smax and a < b ? a : b on unsigned values umin. x < 0 ? -x : x is abs, where only an nsw
+; negation makes abs(INT_MIN) poison. a > b ? a : c picks a value the compare didn't look at, so it stays.
+
+define dso_local i32 @max(i32 noundef %a, i32 noundef %b) {
+  %max.cmp = icmp sgt i32 %a, %b
+  %max = select i1 %max.cmp, i32 %a, i32 %b
+  ret i32 %max
+}
+
+define dso_local i32 @umin(i32 noundef %a, i32 noundef %b) {
+  %umin.cmp = icmp ult i32 %a, %b
+  %umin = select i1 %umin.cmp, i32 %a, i32 %b
+  ret i32 %umin
+}
+
+define dso_local i32 @abs_nsw(i32 noundef %x) {
+  %nsw.cmp = icmp slt i32 %x, 0
+  %nsw.neg = sub nsw i32 0, %x
+  %nsw.abs = select i1 %nsw.cmp, i32 %nsw.neg, i32 %x
+  ret i32 %nsw.abs
+}
+
+define dso_local i32 @abs_wrap(i32 noundef %x) {
+  %wrap.cmp = icmp slt i32 %x, 0
+  %wrap.neg = sub i32 0, %x
+  %wrap.abs = select i1 %wrap.cmp, i32 %wrap.neg, i32 %x
+  ret i32 %wrap.abs
+}
+
+define dso_local i32 @other(i32 noundef %a, i32 noundef %b, i32 noundef %c) {
+  %other.cmp = icmp sgt i32 %a, %b
+  %other = select i1 %other.cmp, i32 %a, i32 %c
+  ret i32 %other
+}
+
+define dso_local i32 @main() {
+  %1 = call i32 @max(i32 9, i32 -2)
+  %2 = call i32 @umin(i32 -1, i32 3)
+  %3 = call i32 @abs_nsw(i32 -5)
+  %4 = call i32 @abs_wrap(i32 -6)
+  %5 = call i32 @other(i32 1, i32 2, i32 4)
+  %6 = add nsw i32 %1, %2
+  %7 = add nsw i32 %6, %3
+  %8 = add nsw i32 %7, %4
+  %9 = add nsw i32 %8, %5
+  ret i32 %9
+}
+; CHECK: call i32 @llvm.smax.i32\(i32 %a, i32 %b\)
+; CHECK: call i32 @llvm.umin.i32\(i32 %a, i32 %b\)
+; CHECK: call i32 @llvm.abs.i32\(i32 %x, i1 true\)
+; CHECK: call i32 @llvm.abs.i32\(i32 %x, i1 false\)
+; CHECK: %other = select i1 %other.cmp, i32 %a, i32 %c
@@ -0,0 +1,49 @@
+; Only branches whose condition really is constant may be pruned. The unsigned x < 0 is never taken and goes away,
+; the signed ones are taken for a negative x and have to stay.
+; pick(-5) is 100 + 10 and pick(3) is 1, so main returns 111.
+; CHECK: icmp slt i32 %x, 0
+; CHECK: icmp sle i32 %x, 0
+
+define dso_local i32 @pick(i32 noundef %x) {
+entry:
+  %r = alloca i32, align 4
+  %never = icmp ult i32 %x, 0
+  br i1 %never, label %dead, label %check.neg
+
+dead:
+  store i32 77, i32* %r, align 4
+  br label %check.neg
+
+check.neg:
+  %neg = icmp slt i32 %x, 0
+  br i1 %neg, label %negative, label %positive
+
+negative:
+  store i32 100, i32* %r, align 4
+  br label %check.nonpos
+
+positive:
+  store i32 1, i32* %r, align 4
+  br label %check.nonpos
+
+check.nonpos:
+  %nonpos = icmp sle i32 %x, 0
+  br i1 %nonpos, label %add, label %exit
+
+add:
+  %0 = load i32, i32* %r, align 4
+  %1 = add nsw i32 %0, 10
+  store i32 %1, i32* %r, align 4
+  br label %exit
+
+exit:
+  %2 = load i32, i32* %r, align 4
+  ret i32 %2
+}
+
+define dso_local i32 @main() {
+  %neg = call i32 @pick(i32 -5)
+  %pos = call i32 @pick(i32 3)
+  %1 = add i32 %neg, %pos
+  ret i32 %1
+}
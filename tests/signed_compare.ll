@@ -0,0 +1,25 @@
+; Signed compares against zero may not be folded like unsigned ones: x < 0 is true for a negative x.
+; sign(-3) is 1 + 4 and sign(5) is 2 + 8, so main returns 5 + 16 * 10.
+
+define dso_local i32 @sign(i32 noundef %x) {
+  %lt = icmp slt i32 %x, 0
+  %gt = icmp sgt i32 %x, 0
+  %le = icmp sle i32 %x, 0
+  %ge = icmp sge i32 %x, 0
+  %lt.bit = zext i1 %lt to i32
+  %gt.bit = select i1 %gt, i32 2, i32 0
+  %le.bit = select i1 %le, i32 4, i32 0
+  %ge.bit = select i1 %ge, i32 8, i32 0
+  %1 = or i32 %lt.bit, %gt.bit
+  %2 = or i32 %1, %le.bit
+  %3 = or i32 %2, %ge.bit
+  ret i32 %3
+}
+
+define dso_local i32 @main() {
+  %neg = call i32 @sign(i32 -3)
+  %pos = call i32 @sign(i32 5)
+  %1 = mul i32 %pos, 16
+  %2 = add i32 %neg, %1
+  ret i32 %2
+}
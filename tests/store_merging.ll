@@ -0,0 +1,43 @@
+; Four byte stores into one struct become one i32 store: main has to return 1 + 2*2 + 3*4 + 4*8 + 5 + 6 = 60.
+; The two stores into t leave a gap between them, so they are left alone.
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-pc-linux-gnu"
+
+%struct.S = type { i8, i8, i8, i8 }
+
+define dso_local i32 @main() {
+  %s = alloca %struct.S, align 4
+  %t = alloca %struct.S, align 4
+  %s.a = getelementptr inbounds %struct.S, %struct.S* %s, i32 0, i32 0
+  store i8 1, i8* %s.a, align 4
+  %s.b = getelementptr inbounds %struct.S, %struct.S* %s, i32 0, i32 1
+  store i8 2, i8* %s.b, align 1
+  %s.c = getelementptr inbounds %struct.S, %struct.S* %s, i32 0, i32 2
+  store i8 3, i8* %s.c, align 2
+  %s.d = getelementptr inbounds %struct.S, %struct.S* %s, i32 0, i32 3
+  store i8 4, i8* %s.d, align 1
+  %t.a = getelementptr inbounds %struct.S, %struct.S* %t, i32 0, i32 0
+  store i8 5, i8* %t.a, align 4
+  %t.c = getelementptr inbounds %struct.S, %struct.S* %t, i32 0, i32 2
+  store i8 6, i8* %t.c, align 2
+  %1 = load i8, i8* %s.a, align 4
+  %2 = load i8, i8* %s.b, align 1
+  %3 = load i8, i8* %s.c, align 2
+  %4 = load i8, i8* %s.d, align 1
+  %5 = load i8, i8* %t.a, align 4
+  %6 = load i8, i8* %t.c, align 2
+  %7 = mul i8 %2, 2
+  %8 = mul i8 %3, 4
+  %9 = mul i8 %4, 8
+  %10 = add i8 %1, %7
+  %11 = add i8 %10, %8
+  %12 = add i8 %11, %9
+  %13 = add i8 %12, %5
+  %14 = add i8 %13, %6
+  %15 = zext i8 %14 to i32
+  ret i32 %15
+}
+; CHECK: store i32 67305985
+; CHECK: store i8 5, i8\* %t.a
+; CHECK: store i8 6, i8\* %t.c
+; CHECK-NOT: store i8 [1-4],
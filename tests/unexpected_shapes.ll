@@ -0,0 +1,47 @@
+; Shapes the increment and compare rules don't handle have to be left alone instead of aborting opt:
+; a function without allocas, a variable that is never incremented, a variable initialised from a parameter,
+; and a compare of values that aren't loads.
+; plain(5) is 6, keep(7) is 7 + 1, from_param(3) is 3 + 1 and same(4, 4) is 1, so main returns 6 + 8 + 4 + 1.
+
+define dso_local i32 @plain(i32 noundef %x) {
+  %1 = add nsw i32 %x, 1
+  ret i32 %1
+}
+
+define dso_local i32 @keep(i32 noundef %0) {
+  %2 = alloca i32, align 4
+  %3 = alloca i32, align 4
+  store i32 %0, i32* %2, align 4
+  store i32 1, i32* %3, align 4
+  %4 = load i32, i32* %2, align 4
+  %5 = load i32, i32* %3, align 4
+  %6 = add nsw i32 %4, %5
+  ret i32 %6
+}
+
+define dso_local i32 @from_param(i32 noundef %0) {
+  %2 = alloca i32, align 4
+  store i32 %0, i32* %2, align 4
+  %3 = load i32, i32* %2, align 4
+  %4 = add nsw i32 %3, 1
+  store i32 %4, i32* %2, align 4
+  %5 = load i32, i32* %2, align 4
+  ret i32 %5
+}
+
+define dso_local i32 @same(i32 noundef %a, i32 noundef %b) {
+  %1 = icmp eq i32 %a, %b
+  %2 = zext i1 %1 to i32
+  ret i32 %2
+}
+
+define dso_local i32 @main() {
+  %1 = call i32 @plain(i32 5)
+  %2 = call i32 @keep(i32 7)
+  %3 = call i32 @from_param(i32 3)
+  %4 = call i32 @same(i32 4, i32 4)
+  %5 = add i32 %1, %2
+  %6 = add i32 %5, %3
+  %7 = add i32 %6, %4
+  ret i32 %7
+}